@@ -9,18 +9,35 @@
 void *__start_custom_data;
 void *__stop_custom_data;
 
-/* The unpacked representation of bytecode file */
+/* The representation of a bytecode file (see SM.ByteCode for the format);
+   the file is mapped into memory and its sections are used in place */
 typedef struct {
   char *string_ptr;              /* A pointer to the beginning of the string table */
   int  *public_ptr;              /* A pointer to the beginning of publics table    */
   char *code_ptr;                /* A pointer to the bytecode itself               */
   int  *global_ptr;              /* A pointer to the global area                   */
+  int  *import_ptr;              /* A pointer to the imports table                 */
+  int  *line_ptr;                /* A pointer to the line table                    */
+  int  *global_names;            /* Names of global variables                      */
+  int  *extern_ptr;              /* A pointer to the externs table                 */
+  int  *reloc_ptr;               /* A pointer to the relocations table             */
+  int  *frame_sizes;             /* Stack sizes of functions (set by the verifier) */
+  int   code_size;               /* The size (in bytes) of the code                */
   int   stringtab_size;          /* The size (in bytes) of the string table        */
   int   global_area_size;        /* The size (in words) of global area             */
   int   public_symbols_number;   /* The number of public symbols                   */
-  char  buffer[0];               
+  int   imports_number;          /* The number of imports                          */
+  int   lines_number;            /* The number of line table entries               */
+  int   externs_number;          /* The number of external symbols                 */
+  int   relocs_number;           /* The number of relocations                      */
 } bytefile;
 
+# define BYTEFILE_MAGIC   "LAMA"
+# define BYTEFILE_VERSION 2
+
+enum {SECTION_CODE = 1, SECTION_STRINGS, SECTION_PUBLICS, SECTION_IMPORTS, SECTION_LINES, SECTION_GLOBALS,
+      SECTION_EXTERNS, SECTION_RELOCS};
+
 /* Gets a string from a string table by an index */
 char* get_string (bytefile *f, int pos) {
   return &f->string_ptr[pos];
@@ -36,58 +53,227 @@ int get_public_offset (bytefile *f, int i) {
   return f->public_ptr[i*2+1];
 }
 
-/* Reads a binary bytecode file by name and unpacks it */
+/* Maps a bytecode file by name and locates its sections */
 bytefile* read_file (char *fname) {
-  FILE *f = fopen (fname, "rb");
-  long size;
+  int fd = open (fname, O_RDONLY), i, n, *dir;
+  struct stat st;
+  char *base;
   bytefile *file;
 
-  if (f == 0) {
+  if (fd < 0 || fstat (fd, &st) < 0) {
     failure ("%s\n", strerror (errno));
   }
-  
-  if (fseek (f, 0, SEEK_END) == -1) {
+
+  if (st.st_size < 12) {
+    failure ("%s: not a bytecode file\n", fname);
+  }
+
+  base = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (base == MAP_FAILED) {
     failure ("%s\n", strerror (errno));
   }
 
-  file = (bytefile*) malloc (sizeof(int)*4 + (size = ftell (f)));
+  close (fd);
+  
+  if (memcmp (base, BYTEFILE_MAGIC, 4) != 0) {
+    failure ("%s: not a bytecode file\n", fname);
+  }
+
+  if (((int*) base)[1] != BYTEFILE_VERSION) {
+    failure ("%s: unsupported bytecode version %d\n", fname, ((int*) base)[1]);
+  }
+
+  n   = ((int*) base)[2];
+  dir = (int*) base + 3;
+  
+  if (n < 0 || 12 + 12 * (long) n > st.st_size) {
+    failure ("%s: malformed section directory\n", fname);
+  }
+  
+  file = (bytefile*) calloc (1, sizeof (bytefile));
 
   if (file == 0) {
     failure ("*** FAILURE: unable to allocate memory.\n");
   }
-  
-  rewind (f);
 
-  if (size != fread (&file->stringtab_size, 1, size, f)) {
-    failure ("%s\n", strerror (errno));
+  for (i = 0; i < n; i++) {
+    int   kind = dir[3*i], ofs = dir[3*i+1], size = dir[3*i+2];
+    char *p    = base + ofs;
+
+    if (ofs < 0 || size < 0 || (long) ofs + size > st.st_size) {
+      failure ("%s: section %d is out of the file\n", fname, kind);
+    }
+    
+    switch (kind) {
+    case SECTION_CODE:
+      file->code_ptr  = p;
+      file->code_size = size;
+      break;
+      
+    case SECTION_STRINGS:
+      /* the last string has to be terminated, so none of them runs past the section */
+      if (size == 0 || p[size-1] != 0) failure ("%s: malformed string table\n", fname);
+
+      file->string_ptr     = p;
+      file->stringtab_size = size;
+      break;
+      
+    case SECTION_PUBLICS:
+      file->public_ptr            = (int*) p;
+      file->public_symbols_number = size / (2 * sizeof (int));
+      break;
+      
+    case SECTION_IMPORTS:
+      file->import_ptr     = (int*) p;
+      file->imports_number = size / sizeof (int);
+      break;
+      
+    case SECTION_LINES:
+      file->line_ptr     = (int*) p;
+      file->lines_number = size / (2 * sizeof (int));
+      break;
+      
+    case SECTION_GLOBALS:
+      if (size < (int) sizeof (int)) failure ("%s: malformed globals section\n", fname);
+
+      file->global_area_size = *(int*) p;
+      file->global_names     = (int*) p + 1;
+
+      if (file->global_area_size < 0 ||
+          (long) sizeof (int) * (1 + (long) file->global_area_size) > size) {
+        failure ("%s: malformed globals section\n", fname);
+      }
+      break;
+      
+    case SECTION_EXTERNS:
+      file->extern_ptr     = (int*) p;
+      file->externs_number = size / sizeof (int);
+      break;
+      
+    case SECTION_RELOCS:
+      file->reloc_ptr     = (int*) p;
+      file->relocs_number = size / (2 * sizeof (int));
+      break;
+      
+    default: /* unknown sections are skipped */
+      break;
+    }
+  }
+
+  if (file->code_ptr == NULL || file->string_ptr == NULL) {
+    failure ("%s: no code or string table\n", fname);
   }
   
-  fclose (f);
-  
-  file->string_ptr  = &file->buffer [file->public_symbols_number * 2 * sizeof(int)];
-  file->public_ptr  = (int*) file->buffer;
-  file->code_ptr    = &file->string_ptr [file->stringtab_size];
-  file->global_ptr  = (int*) malloc (file->global_area_size * sizeof (int));
+  file->global_ptr = NULL; /* placed on the operand stack by the interpreter */
   
   return file;
 }
 
+/* Decodes a signed LEB128 operand (at most 5 bytes) not reading past end */
+static inline int read_sleb (char **ip, char *end) {
+  unsigned int r = 0;
+  int shift = 0;
+  unsigned char b;
+
+  do {
+    if (*ip >= end || shift >= 35) failure ("malformed operand in the bytecode\n");
+
+    b = *(*ip)++;
+    r |= (unsigned int) (b & 0x7f) << shift;
+    shift += 7;
+  } while (b & 0x80);
+
+  if (shift < 32 && (b & 0x40)) r |= ~0u << shift;
+
+  return (int) r;
+}
+
+/* Runtime functions (the "F" entries of Std.i) callable from the bytecode.
+   The linker turns calls of them into native calls (0x75 i:v n:v, by an
+   index in this table) and builds a stub (0x76 i:v) for each of them used as
+   a value; read, write, length and string have instructions of their own */
+# define BUILTINS(F)                                                                               \
+  F(assert) F(getEnv) F(system) F(stringInt) F(makeArray) F(clone) F(hash) F(fst) F(snd) F(hd)     \
+  F(tl) F(readLine) F(stringcat) F(matchSubString) F(substring) F(regexp) F(regexpMatch)           \
+  F(advanceMatcher) F(sprintf) F(makeString) F(printf) F(fprintf) F(fprint) F(fopen) F(fclose)     \
+  F(fread) F(fwrite) F(fmap) F(freadChunk) F(freadLine) F(fwriteString) F(failure) F(compare)      \
+  F(i__Infix_4343) F(s__Infix_58) F(s__Infix_3333) F(s__Infix_3838) F(s__Infix_6161)               \
+  F(s__Infix_3361) F(s__Infix_6061) F(s__Infix_60) F(s__Infix_6261) F(s__Infix_62) F(s__Infix_43)  \
+  F(s__Infix_45) F(s__Infix_42) F(s__Infix_47) F(s__Infix_37) F(enableGC) F(disableGC) F(random)   \
+  F(time) F(kindOf) F(compareTags) F(flatCompare) F(structCompare) F(tagHash) F(gcStats)           \
+  F(hashMapCreate) F(hashMapFind) F(hashMapInsert) F(hashMapRemove) F(popCount) F(arrayInsert)     \
+  F(arrayUpdate) F(arrayRemove) F(stringBuilder) F(builderAppend) F(builderAppendChar)             \
+  F(builderAppendInt) F(builderLength) F(builderContents)
+
+# define BUILTIN_MAX_ARGS 16
+
+typedef size_t (*builtin_function) ();
+
+# define BUILTIN_DECL(name) extern void L##name ();
+BUILTINS (BUILTIN_DECL)
+# undef BUILTIN_DECL
+
+static struct {
+  char            *name;
+  builtin_function f;
+} builtins [] = {
+# define BUILTIN_ENTRY(name) {"L" #name, (builtin_function) L##name},
+  BUILTINS (BUILTIN_ENTRY)
+# undef BUILTIN_ENTRY
+};
+
+# define BUILTINS_NUMBER ((int) (sizeof (builtins) / sizeof (builtins [0])))
+
+/* Gets the index of a runtime function by its label, -1 if there is none */
+static int find_builtin (char *name) {
+  int i;
+
+  for (i = 0; i < BUILTINS_NUMBER; i++)
+    if (strcmp (builtins[i].name, name) == 0) return i;
+
+  return -1;
+}
+
+/* Calls the runtime function i with n arguments, the last of which is at
+   args[0] (as on the operand stack). As with cdecl the caller pops the
+   arguments, the unused ones are passed as well, which serves the variadic
+   functions (printf and the like) too */
+static size_t call_builtin (int i, size_t *args, int n) {
+  size_t a [BUILTIN_MAX_ARGS];
+  int    k;
+
+  for (k = 0; k < n; k++) a[k] = args[n-1-k];
+
+  return builtins[i].f (a[0], a[1], a[2],  a[3],  a[4],  a[5],  a[6],  a[7],
+                        a[8], a[9], a[10], a[11], a[12], a[13], a[14], a[15]);
+}
+
 /* Disassembles the bytecode pool */
 void disassemble (FILE *f, bytefile *bf) {
   
-# define INT    (ip += sizeof (int), *(int*)(ip - sizeof (int)))
+# define INT    read_sleb (&ip, end)
+# define LABEL  (ip += sizeof (int), *(int*)(ip - sizeof (int)))
 # define BYTE   *ip++
 # define STRING get_string (bf, INT)
 # define FAIL   failure ("ERROR: invalid opcode %d-%d\n", h, l)
   
   char *ip     = bf->code_ptr;
+  char *end    = bf->code_ptr + bf->code_size;
   char *ops [] = {"+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "!!"};
   char *pats[] = {"=str", "#string", "#array", "#sexp", "#ref", "#val", "#fun"};
   char *lds [] = {"LD", "LDA", "ST"};
+  int   line  = 0;
   do {
-    char x = BYTE,
-         h = (x & 0xF0) >> 4,
-         l = x & 0x0F;
+    char x, h, l;
+
+    /* source lines are shown as per the line table */
+    for (; line < bf->lines_number && bf->line_ptr[2*line] <= ip - bf->code_ptr; line++)
+      fprintf (f, "; line %d\n", bf->line_ptr[2*line+1]);
+
+    x = BYTE;
+    h = (x & 0xF0) >> 4;
+    l = x & 0x0F;
 
     fprintf (f, "0x%.8x:\t", ip-bf->code_ptr-1);
     
@@ -124,7 +310,7 @@ void disassemble (FILE *f, bytefile *bf) {
         break;
         
       case  5:
-        fprintf (f, "JMP\t0x%.8x", INT);
+        fprintf (f, "JMP\t0x%.8x", LABEL);
         break;
         
       case  6:
@@ -172,11 +358,11 @@ void disassemble (FILE *f, bytefile *bf) {
     case 5:
       switch (l) {
       case  0:
-        fprintf (f, "CJMPz\t0x%.8x", INT);
+        fprintf (f, "CJMPz\t0x%.8x", LABEL);
         break;
         
       case  1:
-        fprintf (f, "CJMPnz\t0x%.8x", INT);
+        fprintf (f, "CJMPnz\t0x%.8x", LABEL);
         break;
         
       case  2:
@@ -190,7 +376,7 @@ void disassemble (FILE *f, bytefile *bf) {
         break;
         
       case  4:
-        fprintf (f, "CLOSURE\t0x%.8x", INT);
+        fprintf (f, "CLOSURE\t0x%.8x", LABEL);
         {int n = INT;
          for (int i = 0; i<n; i++) {
          switch (BYTE) {
@@ -209,7 +395,7 @@ void disassemble (FILE *f, bytefile *bf) {
         break;
         
       case  6:
-        fprintf (f, "CALL\t0x%.8x ", INT);
+        fprintf (f, "CALL\t0x%.8x ", LABEL);
         fprintf (f, "%d", INT);
         break;
         
@@ -262,11 +448,89 @@ void disassemble (FILE *f, bytefile *bf) {
         fprintf (f, "CALL\tBarray\t%d", INT);
         break;
 
+      case 5:
+      case 6: {
+        int i = INT;
+
+        if (i < 0 || i >= BUILTINS_NUMBER) FAIL;
+
+        fprintf (f, "%s\t%s", l == 5 ? "CALL" : "BUILTIN", builtins[i].name);
+
+        if (l == 5) fprintf (f, "\t%d", INT);
+        break;
+      }
+
       default:
         FAIL;
       }
     }
     break;
+
+    /* superinstructions */
+    case 8:
+      switch (l) {
+      case 0:
+      case 1:
+        fprintf (f, "DUP;TAG;CJMP%s\t%s ", l ? "nz" : "z", STRING);
+        fprintf (f, "%d ", INT);
+        fprintf (f, "0x%.8x", LABEL);
+        break;
+
+      case 2:
+      case 3:
+        fprintf (f, "DUP;ARRAY;CJMP%s\t%d ", l ? "nz" : "z", INT);
+        fprintf (f, "0x%.8x", LABEL);
+        break;
+
+      case 4:
+        fprintf (f, "DUP;CONST;ELEM\t%d", INT);
+        break;
+
+      case 5:
+        fprintf (f, "LD;LD;BINOP\t%s ", ops[BYTE-1]);
+        for (int i = 0; i<2; i++) {
+          switch (BYTE) {
+          case 0: fprintf (f, "G(%d)", INT); break;
+          case 1: fprintf (f, "L(%d)", INT); break;
+          case 2: fprintf (f, "A(%d)", INT); break;
+          case 3: fprintf (f, "C(%d)", INT); break;
+          default: FAIL;
+          }
+          if (i == 0) fprintf (f, " ");
+        }
+        break;
+
+      case 6:
+        fprintf (f, "CONST;BINOP\t%s ", ops[BYTE-1]);
+        fprintf (f, "%d", INT);
+        break;
+
+      case 7:
+        fprintf (f, "CALL;DROP\t0x%.8x ", LABEL);
+        fprintf (f, "%d", INT);
+        break;
+
+      case 8:
+      case 9:
+        fprintf (f, "BINOP;CJMP%s\t%s ", l == 9 ? "nz" : "z", ops[BYTE-1]);
+        fprintf (f, "0x%.8x", LABEL);
+        break;
+
+      default:
+        FAIL;
+      }
+      break;
+
+    case 9:
+      fprintf (f, "ST;DROP\t");
+      switch (l) {
+      case 0: fprintf (f, "G(%d)", INT); break;
+      case 1: fprintf (f, "L(%d)", INT); break;
+      case 2: fprintf (f, "A(%d)", INT); break;
+      case 3: fprintf (f, "C(%d)", INT); break;
+      default: FAIL;
+      }
+      break;
       
     default:
       FAIL;
@@ -278,24 +542,1509 @@ void disassemble (FILE *f, bytefile *bf) {
  stop: fprintf (f, "<end>\n");
 }
 
-/* Dumps the contents of the file */
-void dump_file (FILE *f, bytefile *bf) {
+/* Gets an offset of a public symbol by its name */
+int find_public (bytefile *f, char *name) {
   int i;
-  
-  fprintf (f, "String table size       : %d\n", bf->stringtab_size);
-  fprintf (f, "Global area size        : %d\n", bf->global_area_size);
-  fprintf (f, "Number of public symbols: %d\n", bf->public_symbols_number);
-  fprintf (f, "Public symbols          :\n");
 
-  for (i=0; i < bf->public_symbols_number; i++) 
-    fprintf (f, "   0x%.8x: %s\n", get_public_offset (bf, i), get_public_name (bf, i));
+  for (i=0; i < f->public_symbols_number; i++)
+    if (strcmp (get_public_name (f, i), name) == 0) return get_public_offset (f, i);
 
-  fprintf (f, "Code:\n");
-  disassemble (f, bf);
+  failure ("public symbol \"%s\" not found\n", name);
+  return -1; // never happens
 }
 
-int main (int argc, char* argv[]) {
-  bytefile *f = read_file (argv[1]);
-  dump_file (stdout, f);
+/* Operand formats of instructions: i --- an integer, s --- a string, l --- a
+   code offset, b --- a byte, x --- a variable index of the kind given by the
+   lower half of the opcode, d --- a designation (a kind and an index), n --- a
+   number of designations which follow */
+static char* operand_format (unsigned char op) {
+  switch (op) {
+  case 0x10: case 0x55: case 0x58: case 0x5a: case 0x74: case 0x76:
+  case 0x84:                                                        return "i";
+  case 0x11:                                                        return "s";
+  case 0x12: case 0x57:                                             return "si";
+  case 0x15: case 0x50: case 0x51:                                  return "l";
+  case 0x52: case 0x53: case 0x59: case 0x75:                       return "ii";
+  case 0x54:                                                        return "ln";
+  case 0x56: case 0x87:                                             return "li";
+  case 0x80: case 0x81:                                             return "sil";
+  case 0x82: case 0x83:                                             return "il";
+  case 0x85:                                                        return "bdd";
+  case 0x86:                                                        return "bi";
+  case 0x88: case 0x89:                                             return "bl";
+  default:
+    if ((op >= 0x01 && op <= 0x0d) || (op >= 0x13 && op <= 0x1b && op != 0x15) ||
+        (op >= 0x60 && op <= 0x66) || (op >= 0x70 && op <= 0x73)) return "";
+
+    if (((op >> 4) == 2 || (op >> 4) == 3 || (op >> 4) == 4 || (op >> 4) == 9) && (op & 0x0F) < 4) return "x";
+
+    return NULL;
+  }
+}
+
+/* The verifier.
+
+   Checks that the code can be run without any dynamic checks of its
+   structure: each path through a function keeps the same depth of the
+   operand stack at every instruction and never takes more values than
+   there are, jumps stay within their function and land on instructions,
+   calls and closures refer to function entries, direct calls pass as many
+   arguments as their targets take ("main" takes two), and variable indices fit
+   the global area and the frames. As a result, the number of words a
+   function may occupy on the stack (its locals, its operands and a frame
+   of a call it makes) is recorded in bf->frame_sizes by the offset of its
+   entry, which allows the interpreter to check for a stack overflow once
+   per call */
+
+# define VERIFY_MAX_OPERANDS 4
+
+typedef struct {
+  int entry;     /* the offset of the BEGIN instruction           */
+  int nargs;     /* the number of arguments                       */
+  int nlocals;   /* the number of locals                          */
+  int ncaptured; /* the number of captured variables              */
+  int depth;     /* the maximal depth of the operand stack so far */
+} verify_function;
+
+/* Decodes an instruction; its scalar operands are put into ops, the code
+   offset (if any) --- into *label, and its designations are checked
+   against the function fn (if not NULL) */
+static char* verify_decode (bytefile *bf, char *ip, int *ops, int *label, verify_function *fn) {
+  unsigned char op   = *ip++;
+  char         *fmt  = operand_format (op), *end = bf->code_ptr + bf->code_size;
+  int           k    = 0, n;
+  int           ofs  = ip - 1 - bf->code_ptr;
+
+  if (fmt == NULL) failure ("verifier: invalid opcode 0x%02x at 0x%08x\n", op, ofs);
+
+# define CHECK(cond, ...) do { if (! (cond)) failure ("verifier: at 0x%08x: " __VA_ARGS__); } while (0)
+# define DESIGNATION(kind) do {                                                                             \
+    int j = read_sleb (&ip, end);                                                                         \
+                                                                                                          \
+    if (fn != NULL)                                                                                       \
+      switch (kind) {                                                                                     \
+      case 0:  CHECK (j >= 0 && j < bf->global_area_size, "invalid global G(%d)\n", ofs, j); break;          \
+      case 1:  CHECK (j >= 0 && j < fn->nlocals,          "invalid local L(%d)\n", ofs, j);  break;          \
+      case 2:  CHECK (j >= 0 && j < fn->nargs,            "invalid argument A(%d)\n", ofs, j); break;        \
+      case 3:  CHECK (j >= 0 && j < fn->ncaptured,        "invalid captured variable C(%d)\n", ofs, j); break; \
+      default: CHECK (0, "invalid designation kind %d\n", ofs, kind);                                        \
+      }                                                                                                   \
+  } while (0)
+
+  for (; *fmt; fmt++)
+    switch (*fmt) {
+    case 'i':
+      ops[k++] = read_sleb (&ip, end);
+      break;
+
+    case 's':
+      ops[k] = read_sleb (&ip, end);
+      CHECK (ops[k] >= 0 && ops[k] < bf->stringtab_size, "invalid string %d\n", ofs, ops[k]);
+      k++;
+      break;
+
+    case 'b':
+      CHECK (ip < end, "truncated instruction\n", ofs);
+      ops[k] = *ip++;
+      CHECK (ops[k] >= 1 && ops[k] <= 13, "invalid binary operator %d\n", ofs, ops[k]);
+      k++;
+      break;
+
+    case 'x':
+      DESIGNATION (op & 0x0F);
+      break;
+
+    case 'd': {
+      int kind;
+
+      CHECK (ip < end, "truncated instruction\n", ofs);
+      kind = *ip++;
+
+      DESIGNATION (kind);
+      break;
+    }
+
+    case 'n':
+      ops[k] = n = read_sleb (&ip, end);
+      CHECK (n >= 0, "invalid number of designations %d\n", ofs, n);
+      k++;
+
+      while (n--) {
+        int kind;
+
+        CHECK (ip < end, "truncated instruction\n", ofs);
+        kind = *ip++;
+
+        DESIGNATION (kind);
+      }
+      break;
+
+    case 'l':
+      CHECK (end - ip >= (long) sizeof (int), "truncated instruction\n", ofs);
+      memcpy (label, ip, sizeof (int));
+      ip += sizeof (int);
+      CHECK (*label >= 0 && *label < bf->code_size, "invalid code offset 0x%08x\n", ofs, *label);
+      break;
+    }
+
+  CHECK (ip <= end, "truncated instruction\n", ofs);
+
+  if (op == 0x75 || op == 0x76) {
+    CHECK (ops[0] >= 0 && ops[0] < BUILTINS_NUMBER, "invalid runtime function %d\n", ofs, ops[0]);
+    CHECK (op == 0x76 || (ops[1] >= 0 && ops[1] <= BUILTIN_MAX_ARGS), "invalid number of arguments %d\n", ofs, ops[1]);
+  }
+
+  return ip;
+
+# undef DESIGNATION
+}
+
+/* Gets the number of arguments of a function by the offset of its entry */
+static int verify_nargs (bytefile *bf, int entry) {
+  int ops [VERIFY_MAX_OPERANDS], label;
+
+  /* a stub of a runtime function takes any number of arguments, but only from CALLC */
+  if ((unsigned char) bf->code_ptr [entry] == 0x76) return -1;
+
+  verify_decode (bf, bf->code_ptr + entry, ops, &label, NULL);
+
+  return ops [0];
+}
+
+void verify (bytefile *bf) {
+  int              *depth    = (int*) malloc (bf->code_size * sizeof (int));
+  int              *owner    = (int*) malloc (bf->code_size * sizeof (int));
+  int              *captured = (int*) malloc (bf->code_size * sizeof (int));
+  int              *work     = (int*) malloc (bf->code_size * sizeof (int));
+  char             *ip       = bf->code_ptr, *end = bf->code_ptr + bf->code_size;
+  int               ops [VERIFY_MAX_OPERANDS], label, i;
+  verify_function   fn;
+
+  bf->frame_sizes = (int*) calloc (bf->code_size + 1, sizeof (int));
+
+  if (! (depth && owner && captured && work && bf->frame_sizes)) {
+    perror ("ERROR: verify: malloc failed");
+    exit   (1);
+  }
+
+  /* depth: -2 --- not an instruction, -1 --- not reached yet;
+     captured: -1 --- not a function entry, INT_MAX --- an entry never referred to */
+  for (i = 0; i < bf->code_size; i++) {
+    depth [i]    = -2;
+    owner [i]    = -1;
+    captured [i] = -1;
+  }
+
+  /* Finds the instructions and the function entries */
+  while (ip < end && (unsigned char) *ip != 0xff) {
+    unsigned char op = *ip;
+
+    depth [ip - bf->code_ptr] = -1;
+
+    if (op == 0x52 || op == 0x53 || op == 0x76) captured [ip - bf->code_ptr] = INT_MAX;
+
+    ip = verify_decode (bf, ip, ops, &label, NULL);
+  }
+
+  if (ip == end) failure ("verifier: no end marker\n");
+
+  /* Counts captured variables available to each function; those which are
+     called directly (including "main") cannot refer to any */
+# define ENTRY(l, ofs)                                                                            \
+  if (captured [l] < 0) failure ("verifier: at 0x%08x: 0x%08x is not a function entry\n", ofs, l)
+
+  for (ip = bf->code_ptr; (unsigned char) *ip != 0xff; ) {
+    unsigned char op  = *ip;
+    int           ofs = ip - bf->code_ptr;
+
+    ip = verify_decode (bf, ip, ops, &label, NULL);
+
+    if (op == 0x54) {
+      ENTRY (label, ofs);
+
+      if (ops [0] < captured [label]) captured [label] = ops [0];
+    }
+    else if (op == 0x56 || op == 0x87) {
+      ENTRY (label, ofs);
+      captured [label] = 0;
+
+      if (ops [0] != verify_nargs (bf, label))
+        failure ("verifier: at 0x%08x: %d argument(s) passed to the function at 0x%08x, %d expected\n",
+                 ofs, ops [0], label, verify_nargs (bf, label));
+    }
+  }
+
+  label = find_public (bf, "main");
+
+  if (label < 0 || label >= bf->code_size) failure ("verifier: invalid offset of \"main\"\n");
+
+  ENTRY (label, label);
+  captured [label] = 0;
+
+  if (verify_nargs (bf, label) != 2) failure ("verifier: \"main\" has to take 2 arguments\n");
+
+  /* Interprets each function abstractly over the depths of its operand stack */
+  for (i = 0; i < bf->code_size; i++) {
+    int top = 0;
+
+    /* functions which are never referred to cannot be run */
+    if (captured [i] < 0 || captured [i] == INT_MAX || (unsigned char) bf->code_ptr [i] == 0x76) continue;
+
+    fn.entry     = i;
+    fn.ncaptured = captured [i];
+    fn.depth     = 0;
+
+    ip = verify_decode (bf, bf->code_ptr + i, ops, &label, NULL);
+
+    fn.nargs   = ops [0];
+    fn.nlocals = ops [1];
+
+    if (fn.nargs < 0 || fn.nlocals < 0) failure ("verifier: at 0x%08x: invalid frame\n", i);
+
+    owner [i] = i;
+    depth [i] = 0;
+
+# define SUCCESSOR(l, d)                                                                        \
+    do {                                                                                        \
+      int s = (l);                                                                              \
+                                                                                                \
+      if (s >= bf->code_size || depth [s] == -2) failure ("verifier: at 0x%08x: 0x%08x is not an instruction\n", ofs, s); \
+                                                                                                \
+      if (owner [s] >= 0 && owner [s] != fn.entry)                                              \
+        failure ("verifier: at 0x%08x: a jump into another function (0x%08x)\n", ofs, s);        \
+                                                                                                \
+      if (depth [s] < 0) {                                                                      \
+        owner [s]    = fn.entry;                                                                \
+        depth [s]    = (d);                                                                     \
+        work [top++] = s;                                                                       \
+      }                                                                                         \
+      else if (depth [s] != (d))                                                                \
+        failure ("verifier: at 0x%08x: stack depth %d differs from %d at 0x%08x\n", ofs, (d), depth [s], s); \
+    } while (0)
+
+    {
+      int ofs = i;
+
+      SUCCESSOR (ip - bf->code_ptr, 0);
+    }
+
+    while (top) {
+      int           ofs  = work [--top], d = depth [ofs], pops = 0, pushes = 0, next = 1, branch = 0;
+      unsigned char op   = bf->code_ptr [ofs];
+      char         *nip  = verify_decode (bf, bf->code_ptr + ofs, ops, &label, &fn);
+
+      switch (op) {
+      case 0x13: case 0x1b: case 0x60:
+      case 0x01 ... 0x0d:               pops = 2;        pushes = 1; break;
+      case 0x10: case 0x11: case 0x54:
+      case 0x70: case 0x85:
+      case 0x20 ... 0x23:
+      case 0x30 ... 0x33:                                pushes = 1; break;
+      case 0x12:                        pops = ops [1];  pushes = 1; break;
+      case 0x14:                        pops = 3;        pushes = 1; break;
+      case 0x15:                        branch = 1;      next = 0;   break;
+      case 0x16:
+        if (d != 1) failure ("verifier: at 0x%08x: stack depth %d at the end of a function\n", ofs, d);
+        next = 0;
+        break;
+      case 0x17: case 0x59:             pops = 1;        pushes = 1; next = 0; break;
+      case 0x18: case 0x90 ... 0x93:    pops = 1;                    break;
+      case 0x19: case 0x84:             pops = 1;        pushes = 2; break;
+      case 0x1a:                        pops = 2;        pushes = 2; break;
+      case 0x40 ... 0x43: case 0x57: case 0x58:
+      case 0x61 ... 0x66: case 0x71 ... 0x73:
+      case 0x86:                        pops = 1;        pushes = 1; break;
+      case 0x50: case 0x51:             pops = 1;        branch = 1; break;
+      case 0x52: case 0x53: case 0x76:
+        failure ("verifier: at 0x%08x: a function entry inside the function at 0x%08x\n", ofs, fn.entry);
+        break;
+      case 0x55:                        pops = ops [0] + 1; pushes = 1; break;
+      case 0x56:                        pops = ops [0];  pushes = 1; break;
+      case 0x5a:                                                     break;
+      case 0x74:                        pops = ops [0];  pushes = 1; break;
+      case 0x75:                        pops = ops [1];  pushes = 1; break;
+      case 0x80 ... 0x83:               pops = 1;        pushes = 1; branch = 1; break;
+      case 0x87:                        pops = ops [0];              break;
+      case 0x88: case 0x89:             pops = 2;        branch = 1; break;
+      }
+
+      if (pops < 0 || d < pops)
+        failure ("verifier: at 0x%08x: %d operand(s) expected, stack depth is %d\n", ofs, pops, d);
+
+      if (d - pops + pushes > fn.depth) fn.depth = d - pops + pushes;
+
+      /* the fused tests (0x80-0x83) keep their operand on both paths */
+      if (branch) SUCCESSOR (label, d - pops + (op >= 0x80 ? pushes : 0));
+      if (next)   SUCCESSOR (nip - bf->code_ptr, d - pops + pushes);
+    }
+
+    /* a call made at the maximal depth pushes a frame of four words */
+    bf->frame_sizes [i] = fn.nlocals + fn.depth + 4;
+  }
+
+# undef SUCCESSOR
+# undef ENTRY
+# undef CHECK
+
+  free (depth);
+  free (owner);
+  free (captured);
+  free (work);
+}
+
+/* The interpreter */
+
+extern size_t __gc_stack_top, __gc_stack_bottom;
+
+extern void  __init            (void);
+extern void  set_args          (int, char*[]);
+extern void* alloc             (size_t);
+extern void* Bstring           (void*);
+extern void* Belem             (void*, int);
+extern void* Bsta              (void*, int, void*);
+extern void* Bsti              (void**, void*);
+extern int   Btag              (void*, int, int);
+extern int   Barray_patt       (void*, int);
+extern int   Bstring_patt      (void*, void*);
+extern int   Bstring_tag_patt  (void*);
+extern int   Barray_tag_patt   (void*);
+extern int   Bsexp_tag_patt    (void*);
+extern int   Bboxed_patt       (void*);
+extern int   Bunboxed_patt     (void*);
+extern int   Bclosure_tag_patt (void*);
+extern void  Bmatch_failure    (void*, char*, int, int);
+extern int   Lread             ();
+extern int   Lwrite            (int);
+extern int   Llength           (void*);
+extern void* Lstring           (void*);
+
+/* The operand stack (in words). It grows downwards, from stack_area + STACK_SIZE to
+   stack_area, and hosts global variables (at the very bottom), frames and operands.
+   For the collector the live part of this area plays the role of the program stack:
+   it is scanned from __gc_stack_top till __gc_stack_bottom, exactly as the hardware
+   stack of natively compiled code.
+*/
+# define STACK_SIZE (4 * 1024 * 1024)
+
+static size_t stack_area [STACK_SIZE];
+
+/* Tag hash: the same encoding as the native code generator uses for S-expression tags */
+static int tag_hash (char *s) {
+  static char *chars = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789'";
+  int h = 0, i;
+
+  for (i = 0; s[i] && i < 5; i++) {
+    char *q = strchr (chars, s[i]);
+
+    if (q == NULL) failure ("tag hash: character not found: %c\n", s[i]);
+
+    h = (h << 6) | (q - chars);
+  }
+
+  return h;
+}
+
+/* Performs a binary operation (numbered as in the bytecode) on boxed operands */
+static inline size_t binop (int op, size_t x, size_t y) {
+  int r;
+  
+  switch (op) {
+  case  1: r = UNBOX(x) +  UNBOX(y); break;
+  case  2: r = UNBOX(x) -  UNBOX(y); break;
+  case  3: r = UNBOX(x) *  UNBOX(y); break;
+  case  4: r = UNBOX(x) /  UNBOX(y); break;
+  case  5: r = UNBOX(x) %  UNBOX(y); break;
+  case  6: r = UNBOX(x) <  UNBOX(y); break;
+  case  7: r = UNBOX(x) <= UNBOX(y); break;
+  case  8: r = UNBOX(x) >  UNBOX(y); break;
+  case  9: r = UNBOX(x) >= UNBOX(y); break;
+  case 10: r = x == y; break;
+  case 11: r = x != y; break;
+  case 12: r = UNBOX(x) && UNBOX(y); break;
+  case 13: r = UNBOX(x) || UNBOX(y); break;
+  default: failure ("ERROR: invalid binary operator %d\n", op);
+  }
+
+  return BOX(r);
+}
+
+/* Runs the bytecode starting from the public symbol "main".
+
+   Frame layout (stack grows downwards):
+
+     args[1]    --- a closure (only for the calls via CALLC)
+     args[0]    --- the first argument; A(i) is args[-i]
+     ...
+     fp[3]      --- stack pointer to restore on return; its lowest bit is set if the
+                    return value is to be dropped (a fused CALL;DROP)
+     fp[2]      --- caller's args pointer
+     fp[1]      --- caller's frame pointer
+     fp[0]      --- return address
+     fp[-1-i]   --- local L(i)
+
+   All these words are either boxed integers or pointers outside the heap, hence
+   the collector simply ignores them.
+*/
+void interpret (bytefile *bf, char *fname, int argc, char *argv[]) {
+  char   *ip    = bf->code_ptr;
+  size_t *sp    = stack_area + STACK_SIZE;
+  size_t *fp    = NULL;
+  size_t *args  = NULL;
+  size_t *glob  = NULL;
+  size_t *limit = stack_area;
+  char   *end   = bf->code_ptr + bf->code_size;
+
+# define INT       read_sleb (&ip, end)
+# define LABEL     (ip += sizeof (int), *(int*)(ip - sizeof (int)))
+# define STRING    get_string (bf, INT)
+# define PUSH(x)   (*--sp = (size_t) (x))
+# define POP       (*sp++)
+# define TOP       (*sp)
+# define CLOSURE   ((size_t*) args[1])
+# define NEXT      goto *dispatch [(unsigned char) *ip++]
+
+  /* Fetches a value by a designation (a kind byte followed by an index) */
+# define LOAD(v)   do { char k = *ip++; int j = INT;                              \
+                        switch (k) {                                             \
+                        case 0: v = glob[j];      break;                         \
+                        case 1: v = fp[-1-j];     break;                         \
+                        case 2: v = args[-j];     break;                         \
+                        case 3: v = CLOSURE[j+1]; break;                         \
+                        default: failure ("ERROR: invalid designation %d\n", k); \
+                        } } while (0)
+
+  /* Must be done prior to any call which may allocate: the live part of the
+     operand stack is [sp, __gc_stack_bottom); __gc_root_scan_stack skips the
+     word at __gc_stack_top itself */
+# define GC_SYNC   (__gc_stack_top = (size_t) (sp - 1))
+
+  static void *dispatch [256] = {
+    [0 ... 255] = &&op_invalid,
+    
+    [0x01 ... 0x0d] = &&op_binop,
+
+    [0x10] = &&op_const,  [0x11] = &&op_string, [0x12] = &&op_sexp,  [0x13] = &&op_sti,
+    [0x14] = &&op_sta,    [0x15] = &&op_jmp,    [0x16] = &&op_end,   [0x17] = &&op_end,
+    [0x18] = &&op_drop,   [0x19] = &&op_dup,    [0x1a] = &&op_swap,  [0x1b] = &&op_elem,
+
+    [0x20] = &&op_ld_g,   [0x21] = &&op_ld_l,   [0x22] = &&op_ld_a,  [0x23] = &&op_ld_c,
+    [0x30] = &&op_lda_g,  [0x31] = &&op_lda_l,  [0x32] = &&op_lda_a, [0x33] = &&op_lda_c,
+    [0x40] = &&op_st_g,   [0x41] = &&op_st_l,   [0x42] = &&op_st_a,  [0x43] = &&op_st_c,
+
+    [0x50] = &&op_cjmpz,  [0x51] = &&op_cjmpnz, [0x52] = &&op_begin, [0x53] = &&op_begin,
+    [0x54] = &&op_closure,[0x55] = &&op_callc,  [0x56] = &&op_call,  [0x57] = &&op_tag,
+    [0x58] = &&op_array,  [0x59] = &&op_fail,   [0x5a] = &&op_line,
+
+    [0x60] = &&op_patt_str,       [0x61] = &&op_patt_string, [0x62] = &&op_patt_array,
+    [0x63] = &&op_patt_sexp,      [0x64] = &&op_patt_boxed,  [0x65] = &&op_patt_unboxed,
+    [0x66] = &&op_patt_closure,
+
+    [0x70] = &&op_lread,  [0x71] = &&op_lwrite, [0x72] = &&op_llength, [0x73] = &&op_lstring,
+    [0x74] = &&op_barray, [0x75] = &&op_builtin,
+
+    [0x80] = &&op_dup_tag_cjmp,   [0x81] = &&op_dup_tag_cjmp,   [0x82] = &&op_dup_array_cjmp,
+    [0x83] = &&op_dup_array_cjmp, [0x84] = &&op_dup_const_elem, [0x85] = &&op_ld_ld_binop,
+    [0x86] = &&op_const_binop,    [0x87] = &&op_call_drop,      [0x88] = &&op_binop_cjmp,
+    [0x89] = &&op_binop_cjmp,
+
+    [0x90] = &&op_st_drop_g, [0x91] = &&op_st_drop_l, [0x92] = &&op_st_drop_a, [0x93] = &&op_st_drop_c
+  };
+
+  /* Global area occupies the bottom of the stack; it leaves room for the
+     initial frame */
+  if (bf->global_area_size > STACK_SIZE - 6) failure ("stack overflow\n");
+
+  sp -= bf->global_area_size;
+  glob = sp;
+  bf->global_ptr = (int*) glob;
+
+  for (size_t *p = sp; p < stack_area + STACK_SIZE; p++) *p = BOX(0);
+
+  __init ();
+  __gc_stack_bottom = (size_t) (stack_area + STACK_SIZE);
+
+  GC_SYNC;
+  set_args (argc, argv);
+
+  /* Call main (argc, argv) with a null return address */
+  PUSH (BOX(argc));
+  PUSH (BOX(0));
+  {
+    size_t *rs = sp + 2;
+
+    PUSH (rs);
+    PUSH (args);
+    PUSH (fp);
+    PUSH (NULL);
+    fp   = sp;
+    args = rs - 1;
+    ip   = bf->code_ptr + find_public (bf, "main");
+  }
+
+  NEXT;
+
+ op_binop: {
+    size_t y = POP;
+
+    TOP = binop (ip[-1], TOP, y);
+    NEXT;
+  }
+
+ op_const:
+  PUSH (BOX(INT));
+  NEXT;
+
+ op_string: {
+    char *s = STRING;
+
+    GC_SYNC;
+    PUSH (Bstring (s));
+    NEXT;
+  }
+
+ op_sexp: {
+    int   t = tag_hash (STRING), n = INT, i;
+    sexp *r;
+
+    GC_SYNC;
+    r = (sexp*) alloc (sizeof(int) * (n+2));
+    r->tag = t;
+    r->contents.tag = SEXP_TAG | (n << 3);
+
+    for (i=0; i<n; i++) ((int*) r->contents.contents)[i] = sp[n-1-i];
+
+    sp += n;
+    PUSH (r->contents.contents);
+    NEXT;
+  }
+
+ op_sti: {
+    size_t v = POP;
+
+    Bsti ((void**) TOP, (void*) v);
+    TOP = v;
+    NEXT;
+  }
+
+ op_sta: {
+    size_t v = POP, i = POP;
+
+    TOP = (size_t) Bsta ((void*) v, i, (void*) TOP);
+    NEXT;
+  }
+
+ op_jmp:
+  ip = bf->code_ptr + *(int*) ip;
+  NEXT;
+
+ op_end: {
+    size_t v = TOP, rs = fp[3];
+
+    ip   = (char*)   fp[0];
+    sp   = (size_t*) (rs & ~1);
+    args = (size_t*) fp[2];
+    fp   = (size_t*) fp[1];
+
+    if (ip == NULL) return;
+
+    if (! (rs & 1)) PUSH (v);
+    NEXT;
+  }
+
+ op_drop:
+  sp++;
+  NEXT;
+
+ op_dup: {
+    size_t v = TOP;
+
+    PUSH (v);
+    NEXT;
+  }
+
+ op_swap: {
+    size_t v = sp[0];
+
+    sp[0] = sp[1];
+    sp[1] = v;
+    NEXT;
+  }
+
+ op_elem: {
+    int i = POP;
+
+    TOP = (size_t) Belem ((void*) TOP, i);
+    NEXT;
+  }
+
+ op_ld_g: PUSH (glob[INT]);        NEXT;
+ op_ld_l: PUSH (fp[-1-INT]);       NEXT;
+ op_ld_a: PUSH (args[-INT]);       NEXT;
+ op_ld_c: PUSH (CLOSURE[INT+1]);   NEXT;
+
+ op_lda_g: PUSH (&glob[INT]);      NEXT;
+ op_lda_l: PUSH (&fp[-1-INT]);     NEXT;
+ op_lda_a: PUSH (&args[-INT]);     NEXT;
+ op_lda_c: PUSH (&CLOSURE[INT+1]); NEXT;
+
+ op_st_g: glob[INT]      = TOP; NEXT;
+ op_st_l: fp[-1-INT]     = TOP; NEXT;
+ op_st_a: args[-INT]     = TOP; NEXT;
+ op_st_c: Bsti ((void**) &CLOSURE[INT+1], (void*) TOP); NEXT;
+
+ op_cjmpz: {
+    int l = LABEL;
+
+    if (UNBOX(POP) == 0) ip = bf->code_ptr + l;
+    NEXT;
+  }
+
+ op_cjmpnz: {
+    int l = LABEL;
+
+    if (UNBOX(POP) != 0) ip = bf->code_ptr + l;
+    NEXT;
+  }
+
+ op_begin: {
+    int n;
+
+    /* the verified code never takes more stack than the frame size of its function */
+    if (sp - limit < bf->frame_sizes [ip - 1 - bf->code_ptr]) failure ("stack overflow\n");
+
+    (void) INT;
+    n = INT;
+
+    while (n--) PUSH (BOX(0));
+    NEXT;
+  }
+
+ op_closure: {
+    int   l = LABEL, n = INT, i;
+    data *r;
+
+    GC_SYNC;
+    r = (data*) alloc (sizeof(int) * (n+2));
+    r->tag = CLOSURE_TAG | ((n+1) << 3);
+    ((void**) r->contents)[0] = bf->code_ptr + l;
+
+    /* the captured values are fetched after the allocation, which may move them */
+    for (i=0; i<n; i++) {
+      size_t v;
+
+      LOAD (v);
+      ((size_t*) r->contents)[i+1] = v;
+    }
+
+    PUSH (r->contents);
+    NEXT;
+  }
+
+ op_callc: {
+    int     n  = INT;
+    size_t *rs = sp + n + 1;
+    size_t  c  = sp[n];
+    char   *e;
+
+    if (UNBOXED(c) || TAG(TO_DATA(c)->tag) != CLOSURE_TAG) failure ("not a closure in CALLC\n");
+
+    e = ((char**) c)[0] + 1;
+
+    /* a runtime function used as a value: its stub holds its index */
+    if ((unsigned char) e[-1] == 0x76) {
+      size_t r;
+
+      GC_SYNC;
+      r   = call_builtin (read_sleb (&e, end), sp, n);
+      sp += n;
+      TOP = r;
+      NEXT;
+    }
+
+    /* the arity of a closure is not known statically: the nargs operand of its
+       BEGIN is checked here, since arguments are accessed unchecked */
+    if (read_sleb (&e, end) != n) failure ("wrong number of arguments in CALLC\n");
+
+    PUSH (rs);
+    PUSH (args);
+    PUSH (fp);
+    PUSH (ip);
+    fp   = sp;
+    args = rs - 2;
+    ip   = ((char**) c)[0];
+    NEXT;
+  }
+
+ op_call: {
+    int     l  = LABEL, n = INT;
+    size_t *rs = sp + n;
+
+    PUSH (rs);
+    PUSH (args);
+    PUSH (fp);
+    PUSH (ip);
+    fp   = sp;
+    args = rs - 1;
+    ip   = bf->code_ptr + l;
+    NEXT;
+  }
+
+ op_tag: {
+    int t = tag_hash (STRING), n = INT;
+
+    TOP = Btag ((void*) TOP, BOX(t), BOX(n));
+    NEXT;
+  }
+
+ op_array:
+  TOP = Barray_patt ((void*) TOP, BOX(INT));
+  NEXT;
+
+ op_fail: {
+    int l = INT, c = INT;
+
+    Bmatch_failure ((void*) TOP, fname, BOX(l), BOX(c));
+    NEXT;
+  }
+
+ op_line:
+  (void) INT;
+  NEXT;
+
+ op_patt_str: {
+    size_t y = POP;
+
+    TOP = Bstring_patt ((void*) TOP, (void*) y);
+    NEXT;
+  }
+
+ op_patt_string:  TOP = Bstring_tag_patt  ((void*) TOP); NEXT;
+ op_patt_array:   TOP = Barray_tag_patt   ((void*) TOP); NEXT;
+ op_patt_sexp:    TOP = Bsexp_tag_patt    ((void*) TOP); NEXT;
+ op_patt_boxed:   TOP = Bboxed_patt       ((void*) TOP); NEXT;
+ op_patt_unboxed: TOP = Bunboxed_patt     ((void*) TOP); NEXT;
+ op_patt_closure: TOP = Bclosure_tag_patt ((void*) TOP); NEXT;
+
+ op_lread:
+  PUSH (Lread ());
+  NEXT;
+
+ op_lwrite:
+  TOP = Lwrite (TOP);
+  NEXT;
+
+ op_llength:
+  TOP = Llength ((void*) TOP);
+  NEXT;
+
+ op_lstring:
+  GC_SYNC;
+  TOP = (size_t) Lstring ((void*) TOP);
+  NEXT;
+
+ op_barray: {
+    int   n = INT, i;
+    data *r;
+
+    GC_SYNC;
+    r = (data*) alloc (sizeof(int) * (n+1));
+    r->tag = ARRAY_TAG | (n << 3);
+
+    for (i=0; i<n; i++) ((int*) r->contents)[i] = sp[n-1-i];
+
+    sp += n;
+    PUSH (r->contents);
+    NEXT;
+  }
+
+ op_builtin: {
+    int    i = INT, n = INT;
+    size_t r;
+
+    GC_SYNC;
+    r   = call_builtin (i, sp, n);
+    sp += n;
+    PUSH (r);
+    NEXT;
+  }
+
+ op_dup_tag_cjmp: {
+    int nz = ip[-1] & 1, t = tag_hash (STRING), n = INT, l = LABEL;
+
+    if ((UNBOX(Btag ((void*) TOP, BOX(t), BOX(n))) != 0) == nz) ip = bf->code_ptr + l;
+    NEXT;
+  }
+
+ op_dup_array_cjmp: {
+    int nz = ip[-1] & 1, n = INT, l = LABEL;
+
+    if ((UNBOX(Barray_patt ((void*) TOP, BOX(n))) != 0) == nz) ip = bf->code_ptr + l;
+    NEXT;
+  }
+
+ op_dup_const_elem: {
+    size_t v = (size_t) Belem ((void*) TOP, BOX(INT));
+
+    PUSH (v);
+    NEXT;
+  }
+
+ op_ld_ld_binop: {
+    int    op = *ip++;
+    size_t x, y;
+
+    LOAD (x);
+    LOAD (y);
+    PUSH (binop (op, x, y));
+    NEXT;
+  }
+
+ op_const_binop: {
+    int op = *ip++;
+
+    TOP = binop (op, TOP, BOX(INT));
+    NEXT;
+  }
+
+ op_call_drop: {
+    int     l  = LABEL, n = INT;
+    size_t *rs = sp + n;
+
+    PUSH ((size_t) rs | 1);
+    PUSH (args);
+    PUSH (fp);
+    PUSH (ip);
+    fp   = sp;
+    args = rs - 1;
+    ip   = bf->code_ptr + l;
+    NEXT;
+  }
+
+ op_binop_cjmp: {
+    int    nz = ip[-1] & 1, op = *ip++, l = LABEL;
+    size_t y  = POP, x = POP;
+
+    if ((UNBOX(binop (op, x, y)) != 0) == nz) ip = bf->code_ptr + l;
+    NEXT;
+  }
+
+ op_st_drop_g: glob[INT]  = POP; NEXT;
+ op_st_drop_l: fp[-1-INT] = POP; NEXT;
+ op_st_drop_a: args[-INT] = POP; NEXT;
+ op_st_drop_c: {
+    int i = INT;
+
+    Bsti ((void**) &CLOSURE[i+1], (void*) POP);
+    NEXT;
+  }
+
+ op_invalid:
+  failure ("ERROR: invalid opcode %d-%d\n", ((unsigned char) ip[-1] & 0xF0) >> 4, ip[-1] & 0x0F);
+
+# undef INT
+# undef LABEL
+# undef STRING
+# undef PUSH
+# undef POP
+# undef TOP
+# undef CLOSURE
+# undef NEXT
+# undef LOAD
+# undef GC_SYNC
+}
+
+/* Dumps the contents of the file */
+void dump_file (FILE *f, bytefile *bf) {
+  int i;
+  
+  fprintf (f, "Code size               : %d\n", bf->code_size);
+  fprintf (f, "String table size       : %d\n", bf->stringtab_size);
+  fprintf (f, "Global area size        : %d\n", bf->global_area_size);
+  fprintf (f, "Number of public symbols: %d\n", bf->public_symbols_number);
+  fprintf (f, "Public symbols          :\n");
+
+  for (i=0; i < bf->public_symbols_number; i++) 
+    fprintf (f, "   0x%.8x: %s\n", get_public_offset (bf, i), get_public_name (bf, i));
+
+  fprintf (f, "Imports                 :\n");
+
+  for (i=0; i < bf->imports_number; i++)
+    fprintf (f, "   %s\n", get_string (bf, bf->import_ptr[i]));
+
+  fprintf (f, "Line table entries      : %d\n", bf->lines_number);
+  fprintf (f, "Code:\n");
+  disassemble (f, bf);
+}
+
+/* The linker: merges the bytecode files of a program and the units it
+   imports into a single file with no external references.
+
+   The code of each unit is copied instruction by instruction with its
+   string and global indices renumbered (which may change the lengths of
+   LEB128 operands); the code offsets, which are 32-bit, are patched when
+   all the units are laid out. The units are placed in the order of their
+   initialization (imported units first), followed by a start routine, which
+   becomes the new "main": it runs the top-level code of every unit and then
+   calls the main routine of the program. References to the runtime functions
+   (see BUILTINS) are bound to native calls and stubs */
+
+/* A growable byte buffer */
+typedef struct {
+  char *data;
+  int   len;
+  int   cap;
+} buffer;
+
+static void buf_put (buffer *b, void *p, int n) {
+  if (b->len + n > b->cap) {
+    while (b->len + n > b->cap) b->cap = b->cap ? 2 * b->cap : 4096;
+
+    b->data = (char*) realloc (b->data, b->cap);
+
+    if (b->data == NULL) {
+      perror ("ERROR: buf_put: realloc failed");
+      exit   (1);
+    }
+  }
+
+  memcpy (b->data + b->len, p, n);
+  b->len += n;
+}
+
+static void buf_byte (buffer *b, int x) {
+  char c = x;
+
+  buf_put (b, &c, 1);
+}
+
+static void buf_int (buffer *b, int x) {
+  buf_put (b, &x, sizeof (int));
+}
+
+static void buf_sleb (buffer *b, int x) {
+  for (;;) {
+    int byte = x & 0x7f;
+
+    x >>= 7;
+
+    if ((x == 0 && !(byte & 0x40)) || (x == -1 && (byte & 0x40))) {
+      buf_byte (b, byte);
+      return;
+    }
+
+    buf_byte (b, byte | 0x80);
+  }
+}
+
+/* The string table of the image; equal strings are stored once */
+static struct {
+  buffer strings;
+  int   *slots;     /* offsets of strings plus one, 0 for empty slots */
+  int    cap;
+  int    size;
+} link_strings;
+
+static unsigned int string_hash (char *s) {
+  unsigned int h = 5381;
+
+  while (*s) h = h * 33 + (unsigned char) *s++;
+
+  return h;
+}
+
+static int link_string (char *s) {
+  int i;
+
+  if (2 * (link_strings.size + 1) > link_strings.cap) {
+    int *old = link_strings.slots, n = link_strings.cap;
+
+    link_strings.cap   = n ? 2 * n : 1024;
+    link_strings.slots = (int*) calloc (link_strings.cap, sizeof (int));
+
+    if (link_strings.slots == NULL) {
+      perror ("ERROR: link_string: calloc failed");
+      exit   (1);
+    }
+
+    for (i = 0; i < n; i++)
+      if (old[i]) {
+        int j = string_hash (link_strings.strings.data + old[i] - 1) & (link_strings.cap - 1);
+
+        while (link_strings.slots[j]) j = (j + 1) & (link_strings.cap - 1);
+
+        link_strings.slots[j] = old[i];
+      }
+
+    free (old);
+  }
+
+  for (i = string_hash (s) & (link_strings.cap - 1); link_strings.slots[i]; i = (i + 1) & (link_strings.cap - 1))
+    if (strcmp (link_strings.strings.data + link_strings.slots[i] - 1, s) == 0)
+      return link_strings.slots[i] - 1;
+
+  link_strings.slots[i] = link_strings.strings.len + 1;
+  link_strings.size++;
+  buf_put (&link_strings.strings, s, strlen (s) + 1);
+
+  return link_strings.slots[i] - 1;
+}
+
+typedef struct {
+  char     *name;          /* the name of the unit (that of the file without ".bc") */
+  bytefile *bf;
+  int      *global_map;    /* image indices of the unit's globals                   */
+  int      *offset_map;    /* image offsets of the unit's instructions and labels   */
+  int      *reloc_at;      /* relocation symbols by code offsets, or -1             */
+  int       state;         /* 0 --- not visited, 1 --- being visited, 2 --- placed  */
+} unit;
+
+/* A code offset to patch: either with the image offset of a label of a
+   unit, or with the address of an external symbol */
+typedef struct {
+  int   slot;
+  unit *u;
+  int   target;
+  char *symbol;
+} patch;
+
+static unit   *units;
+static int     units_number;
+static unit  **order;
+static int     order_number;
+static patch  *patches;
+static int     patches_number, patches_cap;
+
+# define GLOBAL_PREFIX "global_"
+
+/* Looks a symbol up among the publics of a unit */
+static int unit_public (unit *u, char *name, int *value) {
+  int i;
+
+  for (i = 0; i < u->bf->public_symbols_number; i++)
+    if (strcmp (get_public_name (u->bf, i), name) == 0) {
+      *value = get_public_offset (u->bf, i);
+      return 1;
+    }
+
+  return 0;
+}
+
+static int unit_extern (unit *u, char *name) {
+  int i;
+
+  for (i = 0; i < u->bf->externs_number; i++)
+    if (strcmp (get_string (u->bf, u->bf->extern_ptr[i]), name) == 0) return 1;
+
+  return 0;
+}
+
+/* Finds a definition of a public symbol in any unit */
+static unit* find_definition (char *name, int *value) {
+  int i;
+
+  for (i = 0; i < units_number; i++)
+    if (units[i].state == 2 && unit_public (&units[i], name, value)) return &units[i];
+
+  return NULL;
+}
+
+/* Places a unit after the units it imports */
+static void place_unit (unit *u) {
+  int i, j;
+
+  if (u->state == 2) return;
+  if (u->state == 1) failure ("cyclic import of unit %s\n", u->name);
+
+  u->state = 1;
+
+  for (i = 0; i < u->bf->imports_number; i++) {
+    char *name = get_string (u->bf, u->bf->import_ptr[i]);
+
+    if (strcmp (name, "Std") == 0) continue;
+
+    for (j = 0; j < units_number && strcmp (units[j].name, name) != 0; j++);
+
+    if (j == units_number) failure ("unit %s (imported by %s) is not given\n", name, u->name);
+
+    place_unit (&units[j]);
+  }
+
+  u->state        = 2;
+  order[order_number++] = u;
+}
+
+/* Assigns image indices to the globals of all units; public variables are
+   shared with the units which import them */
+static int link_globals (void) {
+  int k, i, n = 0, value;
+  char sym[256];
+
+  for (k = 0; k < order_number; k++) {
+    unit *u = order[k];
+
+    u->global_map = (int*) malloc ((u->bf->global_area_size + 1) * sizeof (int));
+
+    for (i = 0; i < u->bf->global_area_size; i++) {
+      snprintf (sym, sizeof (sym), "%s%s", GLOBAL_PREFIX, get_string (u->bf, u->bf->global_names[i]));
+
+      u->global_map[i] = unit_public (u, sym, &value) || ! unit_extern (u, sym) ? n++ : -1;
+    }
+  }
+
+  for (k = 0; k < order_number; k++) {
+    unit *u = order[k];
+
+    for (i = 0; i < u->bf->global_area_size; i++)
+      if (u->global_map[i] < 0) {
+        unit *d;
+        
+        snprintf (sym, sizeof (sym), "%s%s", GLOBAL_PREFIX, get_string (u->bf, u->bf->global_names[i]));
+
+        if ((d = find_definition (sym, &value)) == NULL) failure ("undefined variable %s in unit %s\n", sym + strlen (GLOBAL_PREFIX), u->name);
+
+        u->global_map[i] = d->global_map[value];
+      }
+  }
+
+  return n;
+}
+
+static void add_patch (int slot, unit *u, int target, char *symbol) {
+  if (patches_number == patches_cap) {
+    patches_cap = patches_cap ? 2 * patches_cap : 1024;
+    patches     = (patch*) realloc (patches, patches_cap * sizeof (patch));
+
+    if (patches == NULL) {
+      perror ("ERROR: add_patch: realloc failed");
+      exit   (1);
+    }
+  }
+
+  patches[patches_number].slot     = slot;
+  patches[patches_number].u        = u;
+  patches[patches_number].target   = target;
+  patches[patches_number++].symbol = symbol;
+}
+
+/* Copies a variable index of a given kind, renumbering globals */
+static void link_index (buffer *out, unit *u, int kind, char **ip) {
+  int i = read_sleb (ip, u->bf->code_ptr + u->bf->code_size);
+
+  if (kind == 0) {
+    if (i < 0 || i >= u->bf->global_area_size) failure ("invalid global index %d in unit %s\n", i, u->name);
+    i = u->global_map[i];
+  }
+
+  buf_sleb (out, i);
+}
+
+/* Gets the index of the runtime function an external symbol of u refers to
+   (-1 if the symbol is defined by a unit or is not a runtime function) */
+static int link_builtin (unit *u, int sym) {
+  char *name = get_string (u->bf, sym);
+  int   value;
+
+  return find_definition (name, &value) ? -1 : find_builtin (name);
+}
+
+/* Checks that at least k more bytes of the code of u are available */
+static void link_need (unit *u, char *ip, char *end, int k) {
+  if (end - ip < k) failure ("truncated instruction in unit %s\n", u->name);
+}
+
+static void link_code (buffer *out, unit *u) {
+  char *code = u->bf->code_ptr, *end = code + u->bf->code_size, *ip = code;
+  int   i;
+
+  u->offset_map = (int*) malloc ((u->bf->code_size + 1) * sizeof (int));
+  u->reloc_at   = (int*) malloc ((u->bf->code_size + 1) * sizeof (int));
+
+  for (i = 0; i <= u->bf->code_size; i++) u->reloc_at[i] = -1;
+
+  for (i = 0; i < u->bf->relocs_number; i++) {
+    int ofs = u->bf->reloc_ptr[2*i];
+
+    if (ofs < 0 || ofs >= u->bf->code_size) failure ("invalid relocation in unit %s\n", u->name);
+
+    u->reloc_at[ofs] = u->bf->reloc_ptr[2*i+1];
+  }
+
+  while (ip < end && (unsigned char) *ip != 0xff) {
+    unsigned char op  = *ip;
+    char         *fmt = operand_format (op);
+    int           n   = 0;
+
+    if (fmt == NULL) failure ("invalid opcode 0x%x in unit %s\n", op, u->name);
+
+    u->offset_map[ip - code] = out->len;
+
+    /* a call of a runtime function becomes a native call */
+    if ((op == 0x56 || op == 0x87) && end - ip > (long) sizeof (int) &&
+        u->reloc_at[ip + 1 - code] >= 0 && (n = link_builtin (u, u->reloc_at[ip + 1 - code])) >= 0) {
+      ip += 1 + sizeof (int);
+      buf_byte (out, 0x75);
+      buf_sleb (out, n);
+      buf_sleb (out, read_sleb (&ip, end));
+
+      if (op == 0x87) buf_byte (out, 0x18);
+      continue;
+    }
+
+    buf_byte (out, *ip++);
+
+    for (; *fmt; fmt++)
+      switch (*fmt) {
+      case 'i':
+        buf_sleb (out, n = read_sleb (&ip, end));
+        break;
+
+      case 's':
+        buf_sleb (out, link_string (get_string (u->bf, read_sleb (&ip, end))));
+        break;
+
+      case 'b':
+        link_need (u, ip, end, 1);
+        buf_byte (out, *ip++);
+        break;
+
+      case 'x':
+        link_index (out, u, op & 0x0F, &ip);
+        break;
+
+      case 'd':
+        link_need (u, ip, end, 1);
+        buf_byte (out, *ip);
+        link_index (out, u, *ip++, &ip);
+        break;
+
+      case 'n':
+        buf_sleb (out, n = read_sleb (&ip, end));
+
+        if (n < 0) failure ("invalid number of designations %d in unit %s\n", n, u->name);
+
+        while (n--) {
+          link_need (u, ip, end, 1);
+          buf_byte (out, *ip);
+          link_index (out, u, *ip++, &ip);
+        }
+        break;
+
+      case 'l': {
+        int sym;
+
+        link_need (u, ip, end, sizeof (int));
+        sym = u->reloc_at[ip - code];
+
+        u->offset_map[ip - code] = out->len;
+
+        if (sym >= 0) add_patch (out->len, NULL, 0, get_string (u->bf, sym));
+        else add_patch (out->len, u, *(int*) ip, NULL);
+
+        buf_int (out, 0);
+        ip += sizeof (int);
+        break;
+      }
+      }
+  }
+
+  u->offset_map[ip - code] = out->len;
+}
+
+/* Writes an image: the header, the section directory and the page-aligned sections */
+# define LINK_PAGE_SIZE 4096
+
+static void write_image (char *fname, buffer *sections, int *kinds, int n) {
+  FILE *f = fopen (fname, "wb");
+  int   i, ofs = (3 + 3 * n) * sizeof (int), hdr[3] = {0, BYTEFILE_VERSION, n};
+  static char zeros [LINK_PAGE_SIZE];
+
+  if (f == NULL) failure ("%s: %s\n", fname, strerror (errno));
+
+  memcpy (hdr, BYTEFILE_MAGIC, 4);
+  fwrite (hdr, sizeof (int), 3, f);
+
+  for (i = 0; i < n; i++) {
+    int entry[3];
+
+    ofs      = (ofs + LINK_PAGE_SIZE - 1) / LINK_PAGE_SIZE * LINK_PAGE_SIZE;
+    entry[0] = kinds[i];
+    entry[1] = ofs;
+    entry[2] = sections[i].len;
+    fwrite (entry, sizeof (int), 3, f);
+    ofs += sections[i].len;
+  }
+
+  for (i = 0; i < n; i++) {
+    long pos = ftell (f);
+
+    fwrite (zeros, 1, (LINK_PAGE_SIZE - pos % LINK_PAGE_SIZE) % LINK_PAGE_SIZE, f);
+    fwrite (sections[i].data, 1, sections[i].len, f);
+  }
+
+  if (ferror (f) || fclose (f) != 0) failure ("%s: %s\n", fname, strerror (errno));
+}
+
+/* Links the files, the first of which is the program */
+void link_files (char *outname, int n, char *fnames[]) {
+  enum {CODE, STRINGS, PUBLICS, LINES, GLOBALS, SECTIONS};
+  static int kinds [SECTIONS] = {SECTION_CODE, SECTION_STRINGS, SECTION_PUBLICS, SECTION_LINES, SECTION_GLOBALS};
+  buffer     out [SECTIONS];
+  int        i, k, globals, start, value, stubs [BUILTINS_NUMBER];
+
+  memset (out, 0, sizeof (out));
+
+  units_number = n;
+  units        = (unit*)  calloc (n, sizeof (unit));
+  order        = (unit**) calloc (n, sizeof (unit*));
+
+  for (i = 0; i < n; i++) {
+    char *base = strrchr (fnames[i], '/'), *dot;
+
+    units[i].name = strdup (base ? base + 1 : fnames[i]);
+
+    if ((dot = strrchr (units[i].name, '.')) != NULL) *dot = 0;
+
+    units[i].bf = read_file (fnames[i]);
+  }
+
+  place_unit (&units[0]);
+  globals = link_globals ();
+
+  for (k = 0; k < order_number; k++) {
+    unit *u = order[k];
+
+    link_code (&out[CODE], u);
+
+    for (i = 0; i < u->bf->lines_number; i++) {
+      buf_int (&out[LINES], u->offset_map[u->bf->line_ptr[2*i]]);
+      buf_int (&out[LINES], u->bf->line_ptr[2*i+1]);
+    }
+  }
+
+  /* the start routine: BEGIN 2 0; CONST 0; CONST 0; CALL;DROP <init> 2; ...;
+     LD A(0); LD A(1); CALL <main> 2; END */
+  start = out[CODE].len;
+  buf_byte (&out[CODE], 0x52); buf_sleb (&out[CODE], 2); buf_sleb (&out[CODE], 0);
+
+  for (k = 0; k < order_number; k++) {
+    unit *u = order[k];
+
+    if (! unit_public (u, "main", &value)) failure ("unit %s has no main routine\n", u->name);
+
+    if (u != &units[0]) {
+      buf_byte (&out[CODE], 0x10); buf_sleb (&out[CODE], 0);
+      buf_byte (&out[CODE], 0x10); buf_sleb (&out[CODE], 0);
+      buf_byte (&out[CODE], 0x87);
+    }
+    else {
+      buf_byte (&out[CODE], 0x22); buf_sleb (&out[CODE], 0);
+      buf_byte (&out[CODE], 0x22); buf_sleb (&out[CODE], 1);
+      buf_byte (&out[CODE], 0x56);
+    }
+
+    add_patch (out[CODE].len, u, value, NULL);
+    buf_int  (&out[CODE], 0);
+    buf_sleb (&out[CODE], 2);
+  }
+
+  buf_byte (&out[CODE], 0x16);
+
+  /* the stubs of the runtime functions used as values follow */
+  for (k = 0; k < BUILTINS_NUMBER; k++) stubs[k] = -1;
+
+  for (i = 0; i < patches_number; i++)
+    if (patches[i].symbol && find_definition (patches[i].symbol, &value) == NULL &&
+        (k = find_builtin (patches[i].symbol)) >= 0 && stubs[k] < 0) {
+      stubs[k] = out[CODE].len;
+      buf_byte (&out[CODE], 0x76);
+      buf_sleb (&out[CODE], k);
+    }
+
+  buf_byte (&out[CODE], 0xff);
+
+  for (i = 0; i < patches_number; i++) {
+    patch *p = &patches[i];
+    int    target;
+
+    if (p->symbol) {
+      unit *d = find_definition (p->symbol, &value);
+
+      if (d == NULL && (k = find_builtin (p->symbol)) >= 0) target = stubs[k];
+      else {
+        if (d == NULL || strncmp (p->symbol, GLOBAL_PREFIX, strlen (GLOBAL_PREFIX)) == 0)
+          failure ("undefined symbol %s\n", p->symbol);
+
+        target = d->offset_map[value];
+      }
+    }
+    else {
+      if (p->target < 0 || p->target > p->u->bf->code_size) failure ("invalid code offset in unit %s\n", p->u->name);
+
+      target = p->u->offset_map[p->target];
+    }
+
+    memcpy (out[CODE].data + p->slot, &target, sizeof (int));
+  }
+
+  buf_int (&out[PUBLICS], link_string ("main"));
+  buf_int (&out[PUBLICS], start);
+
+  buf_int (&out[GLOBALS], globals);
+
+  {
+    int *names = (int*) calloc (globals + 1, sizeof (int));
+
+    for (k = 0; k < order_number; k++)
+      for (i = 0; i < order[k]->bf->global_area_size; i++)
+        names[order[k]->global_map[i]] = link_string (get_string (order[k]->bf, order[k]->bf->global_names[i]));
+
+    for (i = 0; i < globals; i++) buf_int (&out[GLOBALS], names[i]);
+  }
+
+  out[STRINGS] = link_strings.strings;
+
+  write_image (outname, out, kinds, SECTIONS);
+}
+
+int main (int argc, char* argv[]) {
+  bytefile *f;
+
+  if (argc > 2 && strcmp (argv[1], "-d") == 0) {
+    f = read_file (argv[2]);
+    dump_file (stdout, f);
+    return 0;
+  }
+
+  if (argc > 2 && strcmp (argv[1], "-v") == 0) {
+    f = read_file (argv[2]);
+    verify (f);
+
+    for (int i = 0; i < f->code_size; i++)
+      if (f->frame_sizes[i]) printf ("0x%08x: %d words\n", i, f->frame_sizes[i]);
+
+    return 0;
+  }
+
+  if (argc > 3 && strcmp (argv[1], "-l") == 0) {
+    link_files (argv[2], argc-3, argv+3);
+    return 0;
+  }
+
+  if (argc < 2) {
+    fprintf (stderr, "Usage: byterun [-d | -v] <file.bc> <args>\n"
+                     "       byterun -l <output.bc> <program.bc> <unit.bc>...\n");
+    return 1;
+  }
+  
+  f = read_file (argv[1]);
+
+  if (f->relocs_number) {
+    failure ("%s: unresolved external references (link it with \"byterun -l\")\n", argv[1]);
+  }
+
+  verify (f);
+  
+  interpret (f, argv[1], argc-1, argv+1);
+  
   return 0;
 }
@@ -18,14 +18,20 @@ F,matchSubString;
 F,substring;
 F,regexp;
 F,regexpMatch;
+F,advanceMatcher;
 F,sprintf;
 F,makeString;
 F,printf;
 F,fprintf;
+F,fprint;
 F,fopen;
 F,fclose;
 F,fread;
 F,fwrite;
+F,fmap;
+F,freadChunk;
+F,freadLine;
+F,fwriteString;
 F,failure;
 F,read;
 F,write;
@@ -53,4 +59,20 @@ F,time;
 F,kindOf;
 F,compareTags;
 F,flatCompare;
+F,structCompare;
 F,tagHash;
+F,gcStats;
+F,hashMapCreate;
+F,hashMapFind;
+F,hashMapInsert;
+F,hashMapRemove;
+F,popCount;
+F,arrayInsert;
+F,arrayUpdate;
+F,arrayRemove;
+F,stringBuilder;
+F,builderAppend;
+F,builderAppendChar;
+F,builderAppendInt;
+F,builderLength;
+F,builderContents;
@@ -51,15 +51,15 @@ __post_gc2:
 			popl	%eax
 			ret
 	
-	// Scan stack for roots
-	// strting from __gc_stack_top
-	// till __gc_stack_bottom
+	// Conservatively scan stack for roots
+	// strting from the address given as an argument
+	// (not including it) till __gc_stack_bottom
 __gc_root_scan_stack:
 			pushl	%ebp
 			movl	%esp, %ebp
 			pushl	%ebx
 			pushl	%edx
-			movl	__gc_stack_top, %eax
+			movl	8(%ebp), %eax
 			jmp 	next
 
 loop:
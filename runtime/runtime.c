@@ -31,7 +31,26 @@ typedef struct {
 
 static pool from_space;
 static pool to_space;
+pool         nursery; /* accessed from the compiled code, see inline allocation in X86.ml */
 size_t      *current;
+
+/* Generational part: young objects are allocated in a small nursery and promoted into
+   from_space (the old generation) by minor collections; old-to-young pointers created
+   by mutation are recorded via the write barrier */
+# define IS_YOUNG(p)                                   \
+  (!UNBOXED(p) &&                                      \
+   (size_t)nursery.begin <= (size_t)(p) &&             \
+   (size_t)nursery.end   >  (size_t)(p))
+
+# define IN_OLD_SPACE(p)                               \
+  ((size_t)from_space.begin <= (size_t)(p) &&          \
+   (size_t)from_space.end   >  (size_t)(p))
+
+static void gc_remember (void **p);
+
+# define WRITE_BARRIER(p, v)                                            \
+  do if (IS_YOUNG(v) && IN_OLD_SPACE(p) && !IS_YOUNG(*(void**)(p)))     \
+       gc_remember ((void**)(p)); while (0)
 /* end */
 
 # ifdef __ENABLE_GC__
@@ -51,79 +70,109 @@ void __post_gc_subst () {}
 # endif
 /* end */
 
-# define STRING_TAG  0x00000001
-# define ARRAY_TAG   0x00000003
-# define SEXP_TAG    0x00000005
-# define CLOSURE_TAG 0x00000007 
-# define UNBOXED_TAG 0x00000009 // Not actually a tag; used to return from LkindOf
-
-# define LEN(x) ((x & 0xFFFFFFF8) >> 3)
-# define TAG(x)  (x & 0x00000007)
-
-# define TO_DATA(x) ((data*)((char*)(x)-sizeof(int)))
-# define TO_SEXP(x) ((sexp*)((char*)(x)-2*sizeof(int)))
 #ifdef DEBUG_PRINT // GET_SEXP_TAG is necessary for printing from space
 # define GET_SEXP_TAG(x) (LEN(x))
 #endif
 
-# define UNBOXED(x)  (((int) (x)) &  0x0001)
-# define UNBOX(x)    (((int) (x)) >> 1)
-# define BOX(x)      ((((int) (x)) << 1) | 0x0001)
-
-/* GC extra roots */
-#define MAX_EXTRA_ROOTS_NUMBER 32
+/* GC extra roots: a growable stack of addresses of C variables holding Lama values;
+   besides push/pop, a builtin may take a mark and release all roots above it at once */
+#define INIT_EXTRA_ROOTS_NUMBER 32
 typedef struct {
-  int current_free;
-  void ** roots[MAX_EXTRA_ROOTS_NUMBER];
+  int      current_free;
+  int      capacity;
+  void *** roots;
 } extra_roots_pool;
 
-static extra_roots_pool extra_roots;
+static void *          init_extra_roots_area [INIT_EXTRA_ROOTS_NUMBER];
+static extra_roots_pool extra_roots = {0, INIT_EXTRA_ROOTS_NUMBER, (void***) init_extra_roots_area};
+
+/* GC statistics; always collected, reported by gcStats and, if LAMA_GC_STATS
+   environment variable is set, at exit */
+static struct {
+  unsigned long long allocated;     /* words allocated                      */
+  unsigned long long copied;        /* words copied by all collections      */
+  size_t             survived;      /* words survived the last collection   */
+  int                minor;         /* number of minor collections          */
+  int                major;         /* number of major collections          */
+  int                growths;       /* number of heap growth events         */
+  long long          pause_total;   /* total pause time (in microseconds)   */
+  long long          pause_max;     /* maximal pause time (in microseconds) */
+  int                roots_max;     /* extra roots high-water mark          */
+} gc_stats;
 
 void clear_extra_roots (void) {
   extra_roots.current_free = 0;
 }
 
+static void extend_extra_roots (void) {
+  void ***roots = (void***) malloc (2 * extra_roots.capacity * sizeof (void**));
+
+  if (roots == NULL) {
+    perror ("ERROR: extend_extra_roots: malloc failed");
+    exit   (1);
+  }
+
+  memcpy (roots, extra_roots.roots, extra_roots.current_free * sizeof (void**));
+  
+  if (extra_roots.roots != (void***) init_extra_roots_area) free (extra_roots.roots);
+
+  extra_roots.roots     = roots;
+  extra_roots.capacity *= 2;
+}
+
 void push_extra_root (void ** p) {
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
   printf ("push_extra_root %p %p\n", p, &p); fflush (stdout);
 #endif
-  if (extra_roots.current_free >= MAX_EXTRA_ROOTS_NUMBER) {
-    perror ("ERROR: push_extra_roots: extra_roots_pool overflow");
-    exit   (1);
-  }
+  if (extra_roots.current_free == extra_roots.capacity) extend_extra_roots ();
   extra_roots.roots[extra_roots.current_free] = p;
   extra_roots.current_free++;
+  if (extra_roots.current_free > gc_stats.roots_max)
+    gc_stats.roots_max = extra_roots.current_free;
 #ifdef DEBUG_PRINT
   indent--;
 #endif
 }
 
+/* The consistency of pushes and pops is checked in debug mode only */
 void pop_extra_root (void ** p) {
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
   printf ("pop_extra_root %p %p\n", p, &p); fflush (stdout);
-#endif
   if (extra_roots.current_free == 0) {
     perror ("ERROR: pop_extra_root: extra_roots are empty");
     exit   (1);
   }
+#endif
   extra_roots.current_free--;
-  if (extra_roots.roots[extra_roots.current_free] != p) {
 #ifdef DEBUG_PRINT
+  if (extra_roots.roots[extra_roots.current_free] != p) {
     print_indent ();
     printf ("%i %p %p", extra_roots.current_free,
 	    extra_roots.roots[extra_roots.current_free], p);
     fflush (stdout);
-#endif
     perror ("ERROR: pop_extra_root: stack invariant violation");
     exit   (1);
   }
-#ifdef DEBUG_PRINT
   indent--;
 #endif
 }
 
+int mark_extra_roots (void) {
+  return extra_roots.current_free;
+}
+
+void release_extra_roots (int mark) {
+#ifdef DEBUG_PRINT
+  if (mark < 0 || mark > extra_roots.current_free) {
+    perror ("ERROR: release_extra_roots: invalid mark");
+    exit   (1);
+  }
+#endif
+  extra_roots.current_free = mark;
+}
+
 /* end */
 
 static void vfailure (char *s, va_list args) {
@@ -156,16 +205,6 @@ void Lassert (void *f, char *s, ...) {
   do if (!UNBOXED(x) && TAG(TO_DATA(x)->tag) \
 	 != STRING_TAG) failure ("string value expected in %s\n", memo); while (0)
 
-typedef struct {
-  int tag; 
-  char contents[0];
-} data; 
-
-typedef struct {
-  int tag; 
-  data contents; 
-} sexp;
-
 extern void* alloc    (size_t);
 extern void* Bsexp    (int n, ...);
 extern int   LtagHash (char*);
@@ -444,83 +483,187 @@ static void printStringBuf (char *fmt, ...) {
 
 int is_valid_heap_pointer (void *p);
 
-static void printValue (void *p) {
-  data *a = (data*) BOX(NULL);
-  int i   = BOX(0);
-  if (UNBOXED(p)) printStringBuf ("%d", UNBOX(p));
-  else {
-    if (! is_valid_heap_pointer(p)) {
-      printStringBuf ("0x%x", p);
-      return;
+/* Values are printed either into stringBuf, or, if printFile is set,
+   directly into a file; in the latter case no memory proportional to the
+   size of the value is needed */
+static FILE *printFile = NULL;
+
+static void printChars (char *s, int n) {
+  if (printFile) {
+    if (fwrite (s, 1, n, printFile) != n)
+      failure ("fprint (...): %s\n", strerror (errno));
+    
+    return;
+  }
+
+  while (stringBuf.len - stringBuf.ptr <= n) extendStringBuf ();
+
+  memcpy (&stringBuf.contents[stringBuf.ptr], s, n);
+  stringBuf.ptr += n;
+  stringBuf.contents[stringBuf.ptr] = 0;
+}
+
+static void printString (char *s) {
+  printChars (s, strlen (s));
+}
+
+/* Prints a number in a given base (10 or 16) without going through
+   the formatted output */
+static void printNumber (unsigned int n, int neg, unsigned int base) {
+  char  buf[16];
+  char *q = buf + sizeof (buf);
+
+  do {
+    *--q = "0123456789abcdef"[n % base];
+    n   /= base;
+  } while (n);
+
+  if (neg) *--q = '-';
+
+  printChars (q, buf + sizeof (buf) - q);
+}
+
+static void printInt (int n) {
+  printNumber (n < 0 ? - (unsigned int) n : n, n < 0, 10);
+}
+
+static void printHex (void *p) {
+  printChars ("0x", 2);
+  printNumber ((unsigned int) p, 0, 16);
+}
+
+/* A value is printed iteratively: each compound value being printed has a
+   frame in print_stack, which refers to its remaining fields (or to the rest
+   of a list) and to the string which closes it */
+typedef struct {
+  int  *fields;
+  int   next;
+  int   length;
+  char *close;
+} print_frame;
+
+# define PRINT_LIST (-1)
+
+static struct {
+  print_frame *items;
+  int          size;
+  int          capacity;
+} print_stack;
+
+static void print_push (int *fields, int next, int length, char *close) {
+  if (print_stack.size == print_stack.capacity) {
+    print_stack.capacity = print_stack.capacity ? 2 * print_stack.capacity : 64;
+    print_stack.items    = (print_frame*) realloc (print_stack.items, print_stack.capacity * sizeof (print_frame));
+
+    if (print_stack.items == NULL) {
+      perror ("ERROR: print_push: realloc failed");
+      exit   (1);
     }
+  }
+
+  print_stack.items[print_stack.size].fields = fields;
+  print_stack.items[print_stack.size].next   = next;
+  print_stack.items[print_stack.size].length = length;
+  print_stack.items[print_stack.size++].close = close;
+}
+
+/* Prints a scalar value, or an opening of a compound one, pushing a frame
+   for its fields */
+static void printOpen (void *p) {
+  data *a;
+  
+  if (UNBOXED(p)) {
+    printInt (UNBOX(p));
+    return;
+  }
+  
+  if (! is_valid_heap_pointer(p)) {
+    printHex (p);
+    return;
+  }
     
-    a = TO_DATA(p);
+  a = TO_DATA(p);
 
-    switch (TAG(a->tag)) {      
-    case STRING_TAG:
-      printStringBuf ("\"%s\"", a->contents);
-      break;
+  switch (TAG(a->tag)) {      
+  case STRING_TAG:
+    printChars ("\"", 1);
+    printString (a->contents);
+    printChars ("\"", 1);
+    break;
 
-    case CLOSURE_TAG:
-      printStringBuf ("<closure ");
-      for (i = 0; i < LEN(a->tag); i++) {
-	if (i) printValue ((void*)((int*) a->contents)[i]);
-	else printStringBuf ("0x%x", (void*)((int*) a->contents)[i]);
-	
-	if (i != LEN(a->tag) - 1) printStringBuf (", ");
-      }
-      printStringBuf (">");
-      break;
+  case CLOSURE_TAG:
+    printString ("<closure ");
+    printHex ((void*)((int*) a->contents)[0]);
+    print_push ((int*) a->contents, 1, LEN(a->tag), ">");
+    break;
       
-    case ARRAY_TAG:
-      printStringBuf ("[");
-      for (i = 0; i < LEN(a->tag); i++) {
-        printValue ((void*)((int*) a->contents)[i]);
-	if (i != LEN(a->tag) - 1) printStringBuf (", ");
-      }
-      printStringBuf ("]");
-      break;
+  case ARRAY_TAG:
+    printChars ("[", 1);
+    print_push ((int*) a->contents, 0, LEN(a->tag), "]");
+    break;
       
-    case SEXP_TAG: {
+  case SEXP_TAG: {
 #ifndef DEBUG_PRINT
-      char * tag = de_hash (TO_SEXP(p)->tag);
+    char * tag = de_hash (TO_SEXP(p)->tag);
 #else
-      char * tag = de_hash (GET_SEXP_TAG(TO_SEXP(p)->tag));
+    char * tag = de_hash (GET_SEXP_TAG(TO_SEXP(p)->tag));
 #endif      
       
-      if (strcmp (tag, "cons") == 0) {
-	data *b = a;
-	
-	printStringBuf ("{");
+    if (strcmp (tag, "cons") == 0) {
+      printChars ("{", 1);
+      print_push ((int*) a->contents, 0, PRINT_LIST, "}");
+    }
+    else {
+      printString (tag);
+      
+      if (LEN(a->tag)) {
+        printChars (" (", 2);
+        print_push ((int*) a->contents, 0, LEN(a->tag), ")");
+      }
+    }
+  }
+  break;
 
-	while (LEN(a->tag)) {
-	  printValue ((void*)((int*) b->contents)[0]);
-	  b = (data*)((int*) b->contents)[1];
-	  if (! UNBOXED(b)) {
-	    printStringBuf (", ");
-	    b = TO_DATA(b);
-	  }
-	  else break;
-	}
-	
-	printStringBuf ("}");
+  default:
+    printString ("*** invalid tag: ");
+    printHex ((void*) TAG(a->tag));
+    printString (" ***");
+  }
+}
+
+static void printValue (void *p) {
+  int base = print_stack.size;
+
+  printOpen (p);
+
+  while (print_stack.size > base) {
+    print_frame *f = &print_stack.items[print_stack.size - 1];
+
+    if (f->length == PRINT_LIST) {
+      /* f->fields is a cons cell, or NULL at the end of the list */
+      if (f->fields == NULL) {
+        printString (f->close);
+        print_stack.size--;
       }
       else {
-	printStringBuf ("%s", tag);
-	if (LEN(a->tag)) {
-	  printStringBuf (" (");
-	  for (i = 0; i < LEN(a->tag); i++) {
-	    printValue ((void*)((int*) a->contents)[i]);
-	    if (i != LEN(a->tag) - 1) printStringBuf (", ");
-	  }
-	  printStringBuf (")");
-	}
+        int *cell = f->fields;
+        
+        if (f->next) printChars (", ", 2);
+
+        f->next   = 1;
+        f->fields = UNBOXED(cell[1]) ? NULL : (int*) TO_DATA(cell[1])->contents;
+        
+        printOpen ((void*) cell[0]);
       }
     }
-    break;
-
-    default:
-      printStringBuf ("*** invalid tag: 0x%x ***", TAG(a->tag));
+    else if (f->next == f->length) {
+      printString (f->close);
+      print_stack.size--;
+    }
+    else {
+      if (f->next) printChars (", ", 2);
+      
+      printOpen ((void*) f->fields[f->next++]);
     }
   }
 }
@@ -601,7 +744,8 @@ extern void* Lsubstring (void *subj, int p, int l) {
 
     r->tag = STRING_TAG | (ll << 3);
 
-    strncpy (r->contents, (char*) subj + pp, ll);
+    memcpy (r->contents, (char*) subj + pp, ll);
+    r->contents[ll] = 0;
     
     __post_gc ();
 
@@ -612,252 +756,941 @@ extern void* Lsubstring (void *subj, int p, int l) {
             subject length=%d)", pp, ll, LEN(d->tag));
 }
 
-extern struct re_pattern_buffer *Lregexp (char *regexp) {
-  regex_t *b = (regex_t*) malloc (sizeof (regex_t));
+extern void* LmakeArray (int);
 
-  memset (b, 0, sizeof (regex_t));
-  
-  int n = (int) re_compile_pattern (regexp, strlen (regexp), b);
-  
-  if (n != 0) {
-    failure ("%", strerror (n));
-  };
+/* Moves a matcher [buf, pos, line, col] (see Matcher.lama) n characters
+   forward; returns a new matcher with line and column numbers recalculated */
+extern void* LadvanceMatcher (void *m, int n) {
+  char  *buf;
+  int    pos, end, line, col, i;
+  void **r;
 
-  return b;
-}
+  ASSERT_BOXED("advanceMatcher:1", m);
+  ASSERT_UNBOXED("advanceMatcher:2", n);
 
-extern int LregexpMatch (struct re_pattern_buffer *b, char *s, int pos) {
-  int res;
-  
-  ASSERT_BOXED("regexpMatch:1", b);
-  ASSERT_STRING("regexpMatch:2", s);
-  ASSERT_UNBOXED("regexpMatch:3", pos);
+  if (TAG(TO_DATA(m)->tag) != ARRAY_TAG || LEN(TO_DATA(m)->tag) != 4 ||
+      UNBOXED(((void**) m)[0]) || TAG(TO_DATA(((void**) m)[0])->tag) != STRING_TAG)
+    failure ("advanceMatcher: not a matcher\n");
 
-  res = re_match (b, s, LEN(TO_DATA(s)->tag), UNBOX(pos), 0);
+  buf  = ((char**) m)[0];
+  pos  = UNBOX(((int*) m)[1]);
+  end  = pos + UNBOX(n);
+  line = UNBOX(((int*) m)[2]);
+  col  = UNBOX(((int*) m)[3]);
 
-  if (res) {
-    return BOX (res);
-  }
+  if (UNBOX(n) < 0)
+    failure ("advanceMatcher: negative shift %d\n", UNBOX(n));
 
-  return BOX (res);
-}
+  if (end > LEN(TO_DATA(buf)->tag))
+    failure ("advanceMatcher: index out of bounds (position=%d, shift=%d, \
+              subject length=%d)", pos, UNBOX(n), LEN(TO_DATA(buf)->tag));
 
-extern void* Bstring (void*);
+  for (i = pos; i < end; i++)
+    switch (buf[i]) {
+    case '\n': line++; col = 1; break;
+    case '\t': col += 8; break;
+    default  : col++;
+    }
 
-void *Lclone (void *p) {
-  data *obj;
-  sexp *sobj;
-  void* res;
-  int n;
-#ifdef DEBUG_PRINT
-  register int * ebp asm ("ebp");
-  indent++; print_indent ();
-  printf ("Lclone arg: %p %p\n", &p, p); fflush (stdout);
-#endif
   __pre_gc ();
-  
-  if (UNBOXED(p)) return p;
-  else {
-    data *a = TO_DATA(p);
-    int t   = TAG(a->tag), l = LEN(a->tag);
 
-    push_extra_root (&p);
-    switch (t) {
-    case STRING_TAG:
-#ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("Lclone: string1 &p=%p p=%p\n", &p, p); fflush (stdout);
-#endif
-      res = Bstring (TO_DATA(p)->contents);
-#ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("Lclone: string2 %p %p\n", &p, p); fflush (stdout);
-#endif
-      break;
+  push_extra_root (&m);
+  r = (void**) LmakeArray (BOX(4));
+  pop_extra_root (&m);
 
-    case ARRAY_TAG:      
-    case CLOSURE_TAG:
-#ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("Lclone: closure or array &p=%p p=%p ebp=%p\n", &p, p, ebp); fflush (stdout);
-#endif
-      obj = (data*) alloc (sizeof(int) * (l+1));
-      memcpy (obj, TO_DATA(p), sizeof(int) * (l+1));
-      res = (void*) (obj->contents);
-      break;
-      
-    case SEXP_TAG:
-#ifdef DEBUG_PRINT
-      print_indent (); printf ("Lclone: sexp\n"); fflush (stdout);
-#endif
-      sobj = (sexp*) alloc (sizeof(int) * (l+2));
-      memcpy (sobj, TO_SEXP(p), sizeof(int) * (l+2));
-      res = (void*) sobj->contents.contents;
-      break;
-       
-    default:
-      failure ("invalid tag %d in clone *****\n", t);
-    }
-    pop_extra_root (&p);
-  }
-#ifdef DEBUG_PRINT
-  print_indent (); printf ("Lclone ends1\n"); fflush (stdout);
-#endif
+  r[0] = ((void**) m)[0];
+  r[1] = (void*) BOX(end);
+  r[2] = (void*) BOX(line);
+  r[3] = (void*) BOX(col);
 
   __post_gc ();
-#ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("Lclone ends2\n"); fflush (stdout);
-  indent--;
-#endif
-  return res;
-}
 
-# define HASH_DEPTH 3
-# define HASH_APPEND(acc, x) (((acc + (unsigned) x) << (WORD_SIZE / 2)) | ((acc + (unsigned) x) >> (WORD_SIZE / 2)))
+  return r;
+}
 
-int inner_hash (int depth, unsigned acc, void *p) {
-  if (depth > HASH_DEPTH) return acc;
+/* Regular expressions are compiled once per pattern and cached in a
+   process-wide table. Patterns in the subset of the default (Emacs) GNU
+   syntax without anchors, back references and special escapes are also
+   translated into a Thompson NFA, from which a DFA over byte classes is
+   built lazily; the DFA finds the longest match, exactly as re_match does.
+   Other patterns, as well as those whose DFA grows beyond DFA_MAX_STATES,
+   are matched with GNU regex */
+# define REGEXP_BUCKETS 256
+# define DFA_MAX_STATES 1024
 
-  if (UNBOXED(p)) return HASH_APPEND(acc, UNBOX(p));
-  else if (is_valid_heap_pointer (p)) {
-    data *a = TO_DATA(p);
-    int t = TAG(a->tag), l = LEN(a->tag), i;
+# define NFA_CHARS 0
+# define NFA_EPS   1
+# define NFA_MATCH 2
 
-    acc = HASH_APPEND(acc, t);
-    acc = HASH_APPEND(acc, l);    
+# define DFA_UNKNOWN (-1)
+# define DFA_DEAD    (-2)
 
-    switch (t) {
-    case STRING_TAG: {
-      char *p = a->contents;
+typedef struct {
+  int type;
+  int out;
+  int out1;   /* the second epsilon edge for NFA_EPS, or -1 */
+  int chars;  /* the index of a byte set for NFA_CHARS      */
+} nfa_state;
 
-      while (*p) {
-        int n = (int) *p++;
-	acc = HASH_APPEND(acc, n);
-      }
+typedef struct {
+  int start;
+  int end;    /* a NFA_EPS state with a dangling edge */
+} nfa_fragment;
+
+typedef struct compiled_regexp {
+  struct re_pattern_buffer gnu;  /* must be the first: see LregexpMatch */
+  char                    *source;
+  struct compiled_regexp  *next;
+  int                      use_dfa;
+
+  /* NFA */
+  nfa_state               *nfa;
+  int                      nfa_size, nfa_capacity;
+  unsigned char          (*sets)[32];
+  int                      sets_size, sets_capacity;
+  int                      nfa_start;
+
+  /* DFA: states are sorted sets of NFA states, transitions are filled on demand */
+  unsigned char            classes[256];
+  unsigned char            class_rep[256];
+  int                      nclasses;
+  int                    **states;
+  unsigned                *hashes;
+  char                    *accepting;
+  int                     *trans;
+  int                      dfa_size, dfa_capacity;
+} compiled_regexp;
+
+static compiled_regexp *regexp_cache[REGEXP_BUCKETS];
+
+static void* re_realloc (void *p, size_t size) {
+  if ((p = realloc (p, size)) == NULL) {
+    perror ("ERROR: re_realloc: realloc failed");
+    exit   (1);
+  }
 
-      return acc;
-    }
-      
-    case CLOSURE_TAG:
-      acc = HASH_APPEND(acc, ((void**) a->contents)[0]);
-      i = 1;
-      break;
-      
-    case ARRAY_TAG:
-      i = 0;
-      break;
+  return p;
+}
 
-    case SEXP_TAG: {
-#ifndef DEBUG_PRINT
-      int ta = TO_SEXP(p)->tag;
-#else
-      int ta = GET_SEXP_TAG(TO_SEXP(p)->tag);
-#endif
-      acc = HASH_APPEND(acc, ta);
-      i = 0;
-      break;
-    }
+static int nfa_add (compiled_regexp *re, int type, int out, int out1, int chars) {
+  if (re->nfa_size == re->nfa_capacity) {
+    re->nfa_capacity = re->nfa_capacity ? 2 * re->nfa_capacity : 64;
+    re->nfa          = re_realloc (re->nfa, re->nfa_capacity * sizeof (nfa_state));
+  }
 
-    default:
-      failure ("invalid tag %d in hash *****\n", t);
-    }
+  re->nfa[re->nfa_size].type  = type;
+  re->nfa[re->nfa_size].out   = out;
+  re->nfa[re->nfa_size].out1  = out1;
+  re->nfa[re->nfa_size].chars = chars;
 
-    for (; i<l; i++) 
-      acc = inner_hash (depth+1, acc, ((void**) a->contents)[i]);
+  return re->nfa_size++;
+}
 
-    return acc;
+static int nfa_set (compiled_regexp *re) {
+  if (re->sets_size == re->sets_capacity) {
+    re->sets_capacity = re->sets_capacity ? 2 * re->sets_capacity : 16;
+    re->sets          = re_realloc (re->sets, re->sets_capacity * 32);
   }
-  else return HASH_APPEND(acc, p);
+
+  memset (re->sets[re->sets_size], 0, 32);
+
+  return re->sets_size++;
 }
 
-extern void* LstringInt (char *b) {
-  int n;
-  sscanf (b, "%d", &n);
-  return (void*) BOX(n);
+# define SET_HAS(s, c) ((s)[(unsigned char) (c) >> 3] &   (1 << ((unsigned char) (c) & 7)))
+# define SET_ADD(s, c) ((s)[(unsigned char) (c) >> 3] |=  (1 << ((unsigned char) (c) & 7)))
+
+static nfa_fragment nfa_empty (compiled_regexp *re) {
+  nfa_fragment f;
+
+  f.start = f.end = nfa_add (re, NFA_EPS, -1, -1, 0);
+
+  return f;
 }
 
-extern int Lhash (void *p) {
-  return BOX(0x3fffff & inner_hash (0, 0, p));
+static nfa_fragment nfa_chars (compiled_regexp *re, int set) {
+  nfa_fragment f;
+
+  f.end   = nfa_add (re, NFA_EPS, -1, -1, 0);
+  f.start = nfa_add (re, NFA_CHARS, f.end, -1, set);
+
+  return f;
 }
 
-extern int LflatCompare (void *p, void *q) {
-  if (UNBOXED(p)) {
-    if (UNBOXED(q)) {
-      return BOX (UNBOX(p) - UNBOX(q));
+static int nfa_alt (compiled_regexp *re, char **p, nfa_fragment *f);
+
+/* Parses a bracket expression after "["; returns 0 on unsupported syntax */
+static int nfa_class (compiled_regexp *re, char **p, nfa_fragment *f) {
+  int   set    = nfa_set (re), negate = 0, first = 1, i;
+  char *s      = *p;
+
+  if (*s == '^') negate = 1, s++;
+
+  for (; first || *s != ']'; first = 0) {
+    unsigned char lo = *s, hi;
+
+    if (*s == 0) return 0;
+    if (*s == '[' && (s[1] == ':' || s[1] == '.' || s[1] == '=')) return 0;
+
+    if (s[1] == '-' && s[2] != ']' && s[2] != 0) {
+      hi = s[2];
+      s += 3;
     }
-    
-    return -1;
-  }
-  else if (~UNBOXED(q)) {
-    return BOX(p - q);
+    else hi = *s++;
+
+    for (i = lo; i <= hi; i++) SET_ADD(re->sets[set], i);
   }
-  else BOX(1);
+
+  if (negate)
+    for (i=0; i<32; i++) re->sets[set][i] = ~re->sets[set][i];
+
+  *p = s + 1;
+  *f = nfa_chars (re, set);
+
+  return 1;
 }
 
-extern int Lcompare (void *p, void *q) {
-# define COMPARE_AND_RETURN(x,y) do if (x != y) return BOX(x - y); while (0)
+static int nfa_atom (compiled_regexp *re, char **p, nfa_fragment *f) {
+  char *s = *p;
+  int   set, i;
+
+  switch (*s) {
+  case '^': case '$': case '*': case '+': case '?':
+    return 0;
+
+  case '[':
+    *p = s + 1;
+    return nfa_class (re, p, f);
+
+  case '.':
+    set = nfa_set (re);
+
+    for (i=0; i<256; i++)
+      if (i != '\n') SET_ADD(re->sets[set], i);
+
+    *p = s + 1;
+    *f = nfa_chars (re, set);
+    return 1;
+
+  case '\\':
+    if (s[1] == '(') {
+      *p = s + 2;
+
+      if (! nfa_alt (re, p, f)) return 0;
+      if ((*p)[0] != '\\' || (*p)[1] != ')') return 0;
+
+      *p += 2;
+      return 1;
+    }
+
+    if (s[1] == 0 || s[1] == ')' || s[1] == '|' || s[1] == '{' || s[1] == '}' ||
+	strchr ("wWsSbB<>`'123456789", s[1]))
+      return 0;
+
+    s++;
+    /* fall through: an escaped ordinary character */
+
+  default:
+    set = nfa_set (re);
+    SET_ADD(re->sets[set], *s);
+
+    *p = s + 1;
+    *f = nfa_chars (re, set);
+    return 1;
+  }
+}
+
+static void nfa_concat (compiled_regexp *re, nfa_fragment *f, nfa_fragment g) {
+  re->nfa[f->end].out = g.start;
+  f->end = g.end;
+}
+
+static int nfa_seq (compiled_regexp *re, char **p, nfa_fragment *f) {
+  *f = nfa_empty (re);
+
+  while (**p && ! ((*p)[0] == '\\' && ((*p)[1] == '|' || (*p)[1] == ')'))) {
+    nfa_fragment g;
+
+    if (! nfa_atom (re, p, &g)) return 0;
+
+    for (; **p == '*' || **p == '+' || **p == '?'; (*p)++) {
+      int e = nfa_add (re, NFA_EPS, -1, -1, 0), s;
+
+      switch (**p) {
+      case '*':
+	s = nfa_add (re, NFA_EPS, g.start, e, 0);
+	re->nfa[g.end].out = s;
+	g.start = s;
+	break;
+
+      case '+':
+	s = nfa_add (re, NFA_EPS, g.start, e, 0);
+	re->nfa[g.end].out = s;
+	break;
+
+      case '?':
+	s = nfa_add (re, NFA_EPS, g.start, e, 0);
+	re->nfa[g.end].out = e;
+	g.start = s;
+	break;
+      }
+
+      g.end = e;
+    }
+
+    nfa_concat (re, f, g);
+  }
+
+  return 1;
+}
+
+static int nfa_alt (compiled_regexp *re, char **p, nfa_fragment *f) {
+  if (! nfa_seq (re, p, f)) return 0;
+
+  while ((*p)[0] == '\\' && (*p)[1] == '|') {
+    nfa_fragment g;
+    int          s, e;
+
+    *p += 2;
+
+    if (! nfa_seq (re, p, &g)) return 0;
+
+    e = nfa_add (re, NFA_EPS, -1, -1, 0);
+    s = nfa_add (re, NFA_EPS, f->start, g.start, 0);
+
+    re->nfa[f->end].out = e;
+    re->nfa[g.end].out  = e;
+    f->start = s;
+    f->end   = e;
+  }
+
+  return 1;
+}
+
+/* Splits bytes into classes which no byte set distinguishes */
+static void dfa_classes (compiled_regexp *re) {
+  int i, j, k;
+
+  memset (re->classes, 0, 256);
+  re->nclasses = 1;
+
+  for (k=0; k<re->sets_size; k++) {
+    int map[2][256];
+
+    memset (map, -1, sizeof (map));
+
+    for (i=0, j=0; i<256; i++) {
+      int in = SET_HAS(re->sets[k], i) != 0;
+
+      if (map[in][re->classes[i]] < 0) map[in][re->classes[i]] = j++;
+
+      re->classes[i] = map[in][re->classes[i]];
+    }
+
+    re->nclasses = j;
+  }
+
+  for (i=255; i>=0; i--) re->class_rep[re->classes[i]] = i;
+}
+
+/* Adds the epsilon closure of an NFA state to a set (which is a list of
+   states, marked in an array) */
+static void dfa_closure (compiled_regexp *re, int s, int *list, int *size, char *mark) {
+  while (s >= 0 && ! mark[s]) {
+    mark[s] = 1;
+
+    if (re->nfa[s].type != NFA_EPS) {
+      list[(*size)++] = s;
+      return;
+    }
+
+    dfa_closure (re, re->nfa[s].out1, list, size, mark);
+    s = re->nfa[s].out;
+  }
+}
+
+static int int_compare (const void *a, const void *b) {
+  return *(int*) a - *(int*) b;
+}
+
+/* Finds or adds a DFA state for a set of NFA states; returns -1 if the DFA
+   is too large */
+static int dfa_state (compiled_regexp *re, int *list, int size) {
+  unsigned h = size;
+  int      i, s;
+
+  qsort (list, size, sizeof (int), int_compare);
+
+  for (i=0; i<size; i++) h = h * 31 + list[i];
+
+  for (s=0; s<re->dfa_size; s++)
+    if (re->hashes[s] == h && re->states[s][0] == size &&
+	memcmp (re->states[s] + 1, list, size * sizeof (int)) == 0)
+      return s;
+
+  if (re->dfa_size == DFA_MAX_STATES) return -1;
+
+  /* the tables grow with the states actually reached */
+  if (re->dfa_size == re->dfa_capacity) {
+    re->dfa_capacity = re->dfa_capacity ? 2 * re->dfa_capacity : 16;
+    
+    if (re->dfa_capacity > DFA_MAX_STATES) re->dfa_capacity = DFA_MAX_STATES;
+    
+    re->states    = re_realloc (re->states   , re->dfa_capacity * sizeof (int*));
+    re->hashes    = re_realloc (re->hashes   , re->dfa_capacity * sizeof (unsigned));
+    re->accepting = re_realloc (re->accepting, re->dfa_capacity);
+    re->trans     = re_realloc (re->trans    , re->dfa_capacity * re->nclasses * sizeof (int));
+  }
+
+  s = re->dfa_size++;
+
+  re->states[s]    = re_realloc (NULL, (size + 1) * sizeof (int));
+  re->states[s][0] = size;
+  memcpy (re->states[s] + 1, list, size * sizeof (int));
+
+  re->hashes[s]    = h;
+  re->accepting[s] = 0;
+
+  for (i=0; i<size; i++)
+    if (re->nfa[list[i]].type == NFA_MATCH) re->accepting[s] = 1;
+
+  for (i=0; i<re->nclasses; i++) re->trans[s * re->nclasses + i] = DFA_UNKNOWN;
+
+  return s;
+}
+
+/* Computes a transition; returns -1 if the DFA is too large */
+static int dfa_step (compiled_regexp *re, int s, int c) {
+  int  *list = re_realloc (NULL, re->nfa_size * sizeof (int));
+  char *mark = re_realloc (NULL, re->nfa_size);
+  int   size = 0, i, t;
+
+  memset (mark, 0, re->nfa_size);
+
+  for (i=1; i<=re->states[s][0]; i++) {
+    nfa_state *n = &re->nfa[re->states[s][i]];
+
+    if (n->type == NFA_CHARS && SET_HAS(re->sets[n->chars], re->class_rep[c]))
+      dfa_closure (re, n->out, list, &size, mark);
+  }
+
+  t = size ? dfa_state (re, list, size) : DFA_DEAD;
+
+  if (t != -1) re->trans[s * re->nclasses + c] = t;
+
+  free (list);
+  free (mark);
+
+  return t;
+}
+
+static void dfa_init (compiled_regexp *re) {
+  char        *p = re->source;
+  nfa_fragment f;
+  int         *list;
+  char        *mark;
+  int          size = 0;
+
+  if (! nfa_alt (re, &p, &f) || *p) return;
+
+  size               = nfa_add (re, NFA_MATCH, -1, -1, 0);
+  re->nfa[f.end].out = size;
+  re->nfa_start      = f.start;
+  size               = 0;
+
+  dfa_classes (re);
+
+  list = re_realloc (NULL, re->nfa_size * sizeof (int));
+  mark = re_realloc (NULL, re->nfa_size);
+  memset (mark, 0, re->nfa_size);
+
+  dfa_closure (re, re->nfa_start, list, &size, mark);
+  dfa_state   (re, list, size);
+
+  free (list);
+  free (mark);
+
+  re->use_dfa = 1;
+}
+
+/* Returns the length of the longest match from pos, -1 if there is none, or
+   -2 if the DFA has grown too large */
+static int dfa_match (compiled_regexp *re, unsigned char *s, int len, int pos) {
+  int state = 0, last = re->accepting[0] ? 0 : -1, i;
+
+  for (i = pos; i < len; i++) {
+    int t = re->trans[state * re->nclasses + re->classes[s[i]]];
+
+    if (t == DFA_UNKNOWN && (t = dfa_step (re, state, re->classes[s[i]])) == -1) return -2;
+    if (t == DFA_DEAD) break;
+
+    state = t;
+
+    if (re->accepting[state]) last = i + 1 - pos;
+  }
+
+  return last;
+}
+
+static compiled_regexp* regexp_compile (char *source) {
+  unsigned         h  = 0;
+  compiled_regexp *re;
+  const char      *err;
+  char            *p;
+
+  for (p = source; *p; p++) h = h * 31 + (unsigned char) *p;
+
+  h %= REGEXP_BUCKETS;
+
+  for (re = regexp_cache[h]; re; re = re->next)
+    if (strcmp (re->source, source) == 0) return re;
+
+  re = re_realloc (NULL, sizeof (compiled_regexp));
+  memset (re, 0, sizeof (compiled_regexp));
+
+  if ((err = re_compile_pattern (source, strlen (source), &re->gnu)) != NULL) {
+    failure ("regexp: %s\n", err);
+  }
+
+  re->source = strdup (source);
+  re->next   = regexp_cache[h];
+  regexp_cache[h] = re;
+
+  dfa_init (re);
+
+  return re;
+}
+
+extern struct re_pattern_buffer *Lregexp (char *regexp) {
+  return &regexp_compile (regexp)->gnu;
+}
+
+extern int LregexpMatch (struct re_pattern_buffer *b, char *s, int pos) {
+  compiled_regexp *re = (compiled_regexp*) b;
+  int res;
   
-  if (p == q) return BOX(0);
- 
-  if (UNBOXED(p)) {
-    if (UNBOXED(q)) return BOX(UNBOX(p) - UNBOX(q));    
-    else return BOX(-1);
+  ASSERT_BOXED("regexpMatch:1", b);
+  ASSERT_STRING("regexpMatch:2", s);
+  ASSERT_UNBOXED("regexpMatch:3", pos);
+
+  if (re->use_dfa && UNBOX(pos) <= LEN(TO_DATA(s)->tag)) {
+    res = dfa_match (re, (unsigned char*) s, LEN(TO_DATA(s)->tag), UNBOX(pos));
+
+    if (res != -2) return BOX (res);
+
+    re->use_dfa = 0;
   }
-  else if (UNBOXED(q)) return BOX(1);
+
+  res = re_match (b, s, LEN(TO_DATA(s)->tag), UNBOX(pos), 0);
+
+  return BOX (res);
+}
+
+extern void* Bstring (void*);
+
+void *Lclone (void *p) {
+  data *obj;
+  sexp *sobj;
+  void* res;
+  int n;
+#ifdef DEBUG_PRINT
+  register int * ebp asm ("ebp");
+  indent++; print_indent ();
+  printf ("Lclone arg: %p %p\n", &p, p); fflush (stdout);
+#endif
+  __pre_gc ();
+  
+  if (UNBOXED(p)) return p;
   else {
-    if (is_valid_heap_pointer (p)) {
-      if (is_valid_heap_pointer (q)) {
-        data *a = TO_DATA(p), *b = TO_DATA(q);
-        int ta = TAG(a->tag), tb = TAG(b->tag);
-        int la = LEN(a->tag), lb = LEN(b->tag);
-        int i;
-    
-        COMPARE_AND_RETURN (ta, tb);
-      
-        switch (ta) {
-        case STRING_TAG:
-          return BOX(strcmp (a->contents, b->contents));
-      
-        case CLOSURE_TAG:
-          COMPARE_AND_RETURN (((void**) a->contents)[0], ((void**) b->contents)[0]);
-          COMPARE_AND_RETURN (la, lb);
-          i = 1;
-          break;
+    data *a = TO_DATA(p);
+    int t   = TAG(a->tag), l = LEN(a->tag);
+
+    push_extra_root (&p);
+    switch (t) {
+    case STRING_TAG:
+#ifdef DEBUG_PRINT
+      print_indent ();
+      printf ("Lclone: string1 &p=%p p=%p\n", &p, p); fflush (stdout);
+#endif
+      res = Bstring (TO_DATA(p)->contents);
+#ifdef DEBUG_PRINT
+      print_indent ();
+      printf ("Lclone: string2 %p %p\n", &p, p); fflush (stdout);
+#endif
+      break;
+
+    case ARRAY_TAG:      
+    case CLOSURE_TAG:
+#ifdef DEBUG_PRINT
+      print_indent ();
+      printf ("Lclone: closure or array &p=%p p=%p ebp=%p\n", &p, p, ebp); fflush (stdout);
+#endif
+      obj = (data*) alloc (sizeof(int) * (l+1));
+      memcpy (obj, TO_DATA(p), sizeof(int) * (l+1));
+      res = (void*) (obj->contents);
+      break;
       
-        case ARRAY_TAG:
-          COMPARE_AND_RETURN (la, lb);
-          i = 0;
-          break;
+    case SEXP_TAG:
+#ifdef DEBUG_PRINT
+      print_indent (); printf ("Lclone: sexp\n"); fflush (stdout);
+#endif
+      sobj = (sexp*) alloc (sizeof(int) * (l+2));
+      memcpy (sobj, TO_SEXP(p), sizeof(int) * (l+2));
+      res = (void*) sobj->contents.contents;
+      break;
+       
+    default:
+      failure ("invalid tag %d in clone *****\n", t);
+    }
+    pop_extra_root (&p);
+  }
+#ifdef DEBUG_PRINT
+  print_indent (); printf ("Lclone ends1\n"); fflush (stdout);
+#endif
 
-        case SEXP_TAG: {
+  __post_gc ();
+#ifdef DEBUG_PRINT
+  print_indent ();
+  printf ("Lclone ends2\n"); fflush (stdout);
+  indent--;
+#endif
+  return res;
+}
+
+/* Structural hash: a value is traversed completely with an explicit stack
+   (at most HASH_LIMIT nodes are visited, which also makes cyclic data
+   hashable); every word is mixed in with the MurmurHash3 mixer, and
+   strings are hashed a word at a time */
+# define HASH_LIMIT (1 << 16)
+# define HASH_ROTL(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+static struct {
+  void **items;
+  int    size;
+  int    capacity;
+} hash_stack;
+
+static void hash_push (void *p) {
+  if (hash_stack.size == hash_stack.capacity) {
+    hash_stack.capacity = hash_stack.capacity ? 2 * hash_stack.capacity : 256;
+    hash_stack.items    = (void**) realloc (hash_stack.items, hash_stack.capacity * sizeof (void*));
+
+    if (hash_stack.items == NULL) {
+      perror ("ERROR: hash_push: realloc failed");
+      exit   (1);
+    }
+  }
+
+  hash_stack.items[hash_stack.size++] = p;
+}
+
+static inline unsigned hash_mix (unsigned h, unsigned k) {
+  k *= 0xcc9e2d51;
+  k  = HASH_ROTL(k, 15);
+  k *= 0x1b873593;
+  h ^= k;
+  h  = HASH_ROTL(h, 13);
+  return h * 5 + 0xe6546b64;
+}
+
+static inline unsigned hash_final (unsigned h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+static unsigned hash_string (unsigned h, char *s, int n) {
+  unsigned k;
+  int      i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    memcpy (&k, s + i, 4);
+    h = hash_mix (h, k);
+  }
+
+  for (k = 0; i < n; i++) k = (k << 8) | (unsigned char) s[i];
+
+  return hash_mix (h, k);
+}
+
+static unsigned hash_value (void *v) {
+  unsigned h = 0;
+  int      nodes;
+
+  hash_stack.size = 0;
+  hash_push (v);
+
+  for (nodes = 0; hash_stack.size && nodes < HASH_LIMIT; nodes++) {
+    void *p = hash_stack.items[--hash_stack.size];
+    
+    if (UNBOXED(p)) h = hash_mix (h, UNBOX(p));
+    else if (is_valid_heap_pointer (p)) {
+      data *a = TO_DATA(p);
+      int t = TAG(a->tag), l = LEN(a->tag), i, first;
+
+      h = hash_mix (h, a->tag);
+
+      switch (t) {
+      case STRING_TAG:
+	h = hash_string (h, a->contents, l);
+	continue;
+
+      case CLOSURE_TAG:
+	h = hash_mix (h, ((unsigned*) a->contents)[0]);
+	first = 1;
+	break;
+
+      case ARRAY_TAG:
+	first = 0;
+	break;
+
+      case SEXP_TAG:
 #ifndef DEBUG_PRINT
-          int ta = TO_SEXP(p)->tag, tb = TO_SEXP(q)->tag;      
+	h = hash_mix (h, TO_SEXP(p)->tag);
 #else
-          int ta = GET_SEXP_TAG(TO_SEXP(p)->tag), tb = GET_SEXP_TAG(TO_SEXP(q)->tag);
-#endif      
-          COMPARE_AND_RETURN (ta, tb);
-          COMPARE_AND_RETURN (la, lb);
-          i = 0;
-          break;
-        }
-
-        default:
-          failure ("invalid tag %d in compare *****\n", ta);
-        }
-
-        for (; i<la; i++) {
-          int c = Lcompare (((void**) a->contents)[i], ((void**) b->contents)[i]);
-          if (c != BOX(0)) return BOX(c);
-        }
-    
-        return BOX(0);
+	h = hash_mix (h, GET_SEXP_TAG(TO_SEXP(p)->tag));
+#endif
+	first = 0;
+	break;
+
+      default:
+	failure ("invalid tag %d in hash *****\n", t);
       }
-      else return BOX(-1);
+
+      /* pushed in reverse order to visit the elements left to right */
+      for (i = l-1; i >= first; i--) hash_push (((void**) a->contents)[i]);
     }
-    else if (is_valid_heap_pointer (q)) return BOX(1);
-    else return BOX (p - q);
+    else h = hash_mix (h, (unsigned) p);
   }
+
+  return hash_final (h ^ nodes);
+}
+
+extern void* LstringInt (char *b) {
+  int n;
+  sscanf (b, "%d", &n);
+  return (void*) BOX(n);
+}
+
+extern int Lhash (void *p) {
+  return BOX(0x3fffffff & hash_value (p));
+}
+
+extern int LflatCompare (void *p, void *q) {
+  if (UNBOXED(p)) {
+    if (UNBOXED(q)) {
+      return BOX (UNBOX(p) - UNBOX(q));
+    }
+    
+    return -1;
+  }
+  else if (~UNBOXED(q)) {
+    return BOX(p - q);
+  }
+  else BOX(1);
+}
+
+/* Structural comparison: the pairs of values to compare are kept on an
+   explicit stack, and the elements of two objects are skipped for as long
+   as they are physically equal. After COMPARE_SHARING pairs of objects
+   have been compared, each pair is recorded in a visited table, and a pair
+   met again is considered equal (it either has been found equal already,
+   or is being compared right now). Thus shared and cyclic data are compared
+   in a time linear in their size; no allocations happen on the heap, so
+   object addresses remain stable during the comparison */
+# define COMPARE_SHARING 1024
+
+typedef struct {
+  void *p;
+  void *q;
+} compare_pair;
+
+typedef struct {
+  void    *p;
+  void    *q;
+  unsigned gen;
+} visited_pair;
+
+static struct {
+  compare_pair *items;
+  int           size;
+  int           capacity;
+} compare_stack;
+
+/* Entries of previous comparisons are recognized by an outdated generation
+   and need not be cleared */
+static struct {
+  visited_pair *items;
+  int           size;
+  int           capacity;
+  unsigned      gen;
+} visited;
+
+static void compare_push (void *p, void *q) {
+  if (compare_stack.size == compare_stack.capacity) {
+    compare_stack.capacity = compare_stack.capacity ? 2 * compare_stack.capacity : 256;
+    compare_stack.items    = (compare_pair*) realloc (compare_stack.items, compare_stack.capacity * sizeof (compare_pair));
+
+    if (compare_stack.items == NULL) {
+      perror ("ERROR: compare_push: realloc failed");
+      exit   (1);
+    }
+  }
+
+  compare_stack.items[compare_stack.size].p   = p;
+  compare_stack.items[compare_stack.size++].q = q;
+}
+
+static inline unsigned visited_index (void *p, void *q, int capacity) {
+  return ((unsigned) p * 0x9e3779b1 ^ (unsigned) q * 0x85ebca6b) & (capacity - 1);
+}
+
+static void extend_visited (void) {
+  int           capacity = visited.capacity ? 2 * visited.capacity : 1024, i;
+  visited_pair *items    = (visited_pair*) calloc (capacity, sizeof (visited_pair));
+
+  if (items == NULL) {
+    perror ("ERROR: extend_visited: calloc failed");
+    exit   (1);
+  }
+
+  for (i=0; i<visited.capacity; i++)
+    if (visited.items[i].gen == visited.gen) {
+      unsigned j = visited_index (visited.items[i].p, visited.items[i].q, capacity);
+
+      while (items[j].gen == visited.gen) j = (j + 1) & (capacity - 1);
+
+      items[j] = visited.items[i];
+    }
+
+  free (visited.items);
+  visited.items    = items;
+  visited.capacity = capacity;
+}
+
+/* Records a pair of objects; returns 1 if it has already been recorded */
+static int compare_visited (void *p, void *q) {
+  unsigned i;
+
+  if (2 * (visited.size + 1) > visited.capacity) extend_visited ();
+
+  for (i = visited_index (p, q, visited.capacity);
+       visited.items[i].gen == visited.gen;
+       i = (i + 1) & (visited.capacity - 1))
+    if (visited.items[i].p == p && visited.items[i].q == q) return 1;
+
+  visited.items[i].p   = p;
+  visited.items[i].q   = q;
+  visited.items[i].gen = visited.gen;
+  visited.size++;
+
+  return 0;
+}
+
+/* Returns a negative number, zero or a positive number; if by_kinds is set
+   values of different kinds are ordered by their kinds (see LkindOf),
+   otherwise unboxed values precede all boxed ones */
+static int compare_values (void *p, void *q, int by_kinds) {
+  int n = 0;
+
+  compare_stack.size = 0;
+  visited.size       = 0;
+
+  if (++visited.gen == 0) {
+    memset (visited.items, 0, visited.capacity * sizeof (visited_pair));
+    visited.gen = 1;
+  }
+
+  compare_push (p, q);
+
+  while (compare_stack.size) {
+    data *a, *b;
+    int   ta, tb, la, lb, i, j;
+
+    compare_stack.size--;
+    p = compare_stack.items[compare_stack.size].p;
+    q = compare_stack.items[compare_stack.size].q;
+
+    if (p == q) continue;
+
+    if (UNBOXED(p)) {
+      if (UNBOXED(q)) return UNBOX(p) - UNBOX(q);
+      return by_kinds && is_valid_heap_pointer (q) ? UNBOXED_TAG - TAG(TO_DATA(q)->tag) : -1;
+    }
+
+    if (UNBOXED(q)) 
+      return by_kinds && is_valid_heap_pointer (p) ? TAG(TO_DATA(p)->tag) - UNBOXED_TAG : 1;
+
+    if (! is_valid_heap_pointer (p)) return is_valid_heap_pointer (q) ? 1 : (int) p - (int) q;
+    if (! is_valid_heap_pointer (q)) return -1;
+
+    a  = TO_DATA(p);
+    b  = TO_DATA(q);
+    ta = TAG(a->tag);
+    tb = TAG(b->tag);
+    la = LEN(a->tag);
+    lb = LEN(b->tag);
+
+    if (ta != tb) return ta - tb;
+
+    switch (ta) {
+    case STRING_TAG:
+      if ((i = strcmp (a->contents, b->contents)) != 0) return i;
+      continue;
+
+    case CLOSURE_TAG:
+      if (((int*) a->contents)[0] != ((int*) b->contents)[0])
+	return ((int*) a->contents)[0] - ((int*) b->contents)[0];
+      if (la != lb) return la - lb;
+      i = 1;
+      break;
+
+    case ARRAY_TAG:
+      if (la != lb) return la - lb;
+      i = 0;
+      break;
+
+    case SEXP_TAG: {
+#ifndef DEBUG_PRINT
+      int ta = TO_SEXP(p)->tag, tb = TO_SEXP(q)->tag;
+#else
+      int ta = GET_SEXP_TAG(TO_SEXP(p)->tag), tb = GET_SEXP_TAG(TO_SEXP(q)->tag);
+#endif
+      if (ta != tb) return ta - tb;
+      if (la != lb) return la - lb;
+      i = 0;
+      break;
+    }
+
+    default:
+      failure ("invalid tag %d in compare *****\n", ta);
+    }
+
+    if (n++ >= COMPARE_SHARING && compare_visited (p, q)) continue;
+
+    /* the common prefix of physically equal elements is skipped at once */
+    for (; i<la && ((int*) a->contents)[i] == ((int*) b->contents)[i]; i++);
+
+    /* pushed in reverse order to compare the elements left to right */
+    for (j=la-1; j>=i; j--)
+      if (((int*) a->contents)[j] != ((int*) b->contents)[j])
+	compare_push (((void**) a->contents)[j], ((void**) b->contents)[j]);
+  }
+
+  return 0;
+}
+
+extern int Lcompare (void *p, void *q) {
+  return BOX(compare_values (p, q, 0));
+}
+
+/* Comparison which orders values of different kinds by their kinds; used by
+   "=?=" from Data */
+extern int LstructCompare (void *p, void *q) {
+  return BOX(compare_values (p, q, 1));
 }
 
 extern void* Belem (void *p, int i) {
@@ -913,6 +1746,285 @@ extern void* LmakeString (int length) {
   return r->contents;
 }
 
+/* Hash maps: open addressing with Robin Hood hashing and backward shift
+   deletion. A map is an array [size, hashes, keys, values] of a power of
+   two capacity; the hashes are stored boxed, thus a free slot is the one
+   with a zero hash. Keys are compared by the caller (see HashMap.lama):
+   hashMapFind enumerates the slots holding a given hash */
+# define HASH_MAP_SIZE   0
+# define HASH_MAP_HASHES 1
+# define HASH_MAP_KEYS   2
+# define HASH_MAP_VALUES 3
+
+# define HASH_MAP_FIELD(t, i)    (((void**) (t))[i])
+# define HASH_MAP_CAPACITY(t)    LEN(TO_DATA(HASH_MAP_FIELD(t, HASH_MAP_HASHES))->tag)
+# define HASH_MAP_HOME(h, mask)  (hash_final ((unsigned) (h)) & (mask))
+
+static inline void hash_map_store (void **p, void *v) {
+  WRITE_BARRIER(p, v);
+  *p = v;
+}
+
+/* Places a binding for a key, which is not in the map; does not allocate */
+static void hash_map_place (int *hs, void **ks, void **vs, int capacity, int h, void *k, void *v) {
+  int mask = capacity - 1, i = HASH_MAP_HOME(h, mask), d = 0;
+
+  for (;; i = (i + 1) & mask, d++) {
+    int dist;
+
+    if (hs[i] == 0) {
+      hs[i] = h;
+      hash_map_store (&ks[i], k);
+      hash_map_store (&vs[i], v);
+      return;
+    }
+
+    /* a slot is taken from a binding which is closer to its home */
+    if ((dist = (i - HASH_MAP_HOME(hs[i], mask)) & mask) < d) {
+      int   th = hs[i];
+      void *tk = ks[i], *tv = vs[i];
+
+      hs[i] = h;
+      hash_map_store (&ks[i], k);
+      hash_map_store (&vs[i], v);
+      h = th; k = tk; v = tv; d = dist;
+    }
+  }
+}
+
+/* Replaces the arrays of a map with the arrays of a given capacity */
+static void hash_map_rebuild (void **t, int capacity) {
+  void *hs = NULL, *ks = NULL, *vs = NULL;
+  int   i, n;
+
+  push_extra_root (&hs);
+  push_extra_root (&ks);
+  push_extra_root (&vs);
+
+  hs = LmakeArray (BOX(capacity));
+  ks = LmakeArray (BOX(capacity));
+  vs = LmakeArray (BOX(capacity));
+
+  n = HASH_MAP_FIELD(*t, HASH_MAP_HASHES) ? HASH_MAP_CAPACITY(*t) : 0;
+
+  for (i=0; i<n; i++) {
+    int h = ((int*) HASH_MAP_FIELD(*t, HASH_MAP_HASHES))[i];
+
+    if (h) hash_map_place ((int*) hs, (void**) ks, (void**) vs, capacity, h,
+			   ((void**) HASH_MAP_FIELD(*t, HASH_MAP_KEYS))[i],
+			   ((void**) HASH_MAP_FIELD(*t, HASH_MAP_VALUES))[i]);
+  }
+
+  hash_map_store (&HASH_MAP_FIELD(*t, HASH_MAP_HASHES), hs);
+  hash_map_store (&HASH_MAP_FIELD(*t, HASH_MAP_KEYS)  , ks);
+  hash_map_store (&HASH_MAP_FIELD(*t, HASH_MAP_VALUES), vs);
+
+  pop_extra_root (&vs);
+  pop_extra_root (&ks);
+  pop_extra_root (&hs);
+}
+
+extern void* LhashMapCreate (int n) {
+  void *t;
+  int   capacity = 8;
+
+  ASSERT_UNBOXED("hashMapCreate:1", n);
+
+  while (capacity < 2 * UNBOX(n)) capacity *= 2;
+
+  __pre_gc ();
+
+  t = LmakeArray (BOX(4));
+  HASH_MAP_FIELD(t, HASH_MAP_SIZE) = (void*) BOX(0);
+
+  push_extra_root (&t);
+  hash_map_rebuild (&t, capacity);
+  pop_extra_root (&t);
+
+  __post_gc ();
+
+  return t;
+}
+
+/* Returns the next slot after j (or the first one if j is negative) with
+   the hash h, or -1 */
+extern int LhashMapFind (void *t, int h, int j) {
+  int *hs, mask, i, d;
+
+  ASSERT_BOXED("hashMapFind:1", t);
+  ASSERT_UNBOXED("hashMapFind:2", h);
+  ASSERT_UNBOXED("hashMapFind:3", j);
+
+  hs   = (int*) HASH_MAP_FIELD(t, HASH_MAP_HASHES);
+  mask = HASH_MAP_CAPACITY(t) - 1;
+  i    = UNBOX(j) < 0 ? HASH_MAP_HOME(h, mask) : (UNBOX(j) + 1) & mask;
+  d    = (i - HASH_MAP_HOME(h, mask)) & mask;
+
+  for (;; i = (i + 1) & mask, d++) {
+    if (hs[i] == 0) return BOX(-1);
+    if (hs[i] == h) return BOX(i);
+    if (((i - HASH_MAP_HOME(hs[i], mask)) & mask) < d) return BOX(-1);
+  }
+}
+
+/* Adds a binding for a key, which is not in the map */
+extern void LhashMapInsert (void *t, int h, void *k, void *v) {
+  int n;
+
+  ASSERT_BOXED("hashMapInsert:1", t);
+  ASSERT_UNBOXED("hashMapInsert:2", h);
+
+  __pre_gc ();
+
+  n = UNBOX((int) HASH_MAP_FIELD(t, HASH_MAP_SIZE)) + 1;
+
+  if (4 * n > 3 * HASH_MAP_CAPACITY(t)) {
+    push_extra_root (&t);
+    push_extra_root (&k);
+    push_extra_root (&v);
+    hash_map_rebuild (&t, 2 * HASH_MAP_CAPACITY(t));
+    pop_extra_root (&v);
+    pop_extra_root (&k);
+    pop_extra_root (&t);
+  }
+
+  hash_map_place ((int*) HASH_MAP_FIELD(t, HASH_MAP_HASHES),
+		  (void**) HASH_MAP_FIELD(t, HASH_MAP_KEYS),
+		  (void**) HASH_MAP_FIELD(t, HASH_MAP_VALUES),
+		  HASH_MAP_CAPACITY(t), h, k, v);
+
+  HASH_MAP_FIELD(t, HASH_MAP_SIZE) = (void*) BOX(n);
+
+  __post_gc ();
+}
+
+/* Removes the binding in the slot j */
+extern void LhashMapRemove (void *t, int j) {
+  int   *hs, mask, i, k;
+  void **ks, **vs;
+
+  ASSERT_BOXED("hashMapRemove:1", t);
+  ASSERT_UNBOXED("hashMapRemove:2", j);
+
+  hs   = (int*)   HASH_MAP_FIELD(t, HASH_MAP_HASHES);
+  ks   = (void**) HASH_MAP_FIELD(t, HASH_MAP_KEYS);
+  vs   = (void**) HASH_MAP_FIELD(t, HASH_MAP_VALUES);
+  mask = HASH_MAP_CAPACITY(t) - 1;
+
+  if (UNBOX(j) < 0 || UNBOX(j) > mask || hs[UNBOX(j)] == 0)
+    failure ("hashMapRemove: invalid slot %d\n", UNBOX(j));
+
+  /* the following bindings are shifted back until a free slot or
+     a binding in its home slot */
+  for (i = UNBOX(j); k = (i + 1) & mask, hs[k] && ((k - HASH_MAP_HOME(hs[k], mask)) & mask); i = k) {
+    hs[i] = hs[k];
+    hash_map_store (&ks[i], ks[k]);
+    hash_map_store (&vs[i], vs[k]);
+  }
+
+  hs[i] = 0;
+  ks[i] = vs[i] = NULL;
+
+  HASH_MAP_FIELD(t, HASH_MAP_SIZE) = (void*) BOX(UNBOX((int) HASH_MAP_FIELD(t, HASH_MAP_SIZE)) - 1);
+}
+
+/* Helpers for persistent tries (see Hamt.lama): population count and
+   copying of a node with an element inserted, replaced or removed. A copy
+   is allocated either in the nursery, or in the old generation right after
+   a minor collection, hence no write barrier is needed to fill it */
+extern int LpopCount (int x) {
+  ASSERT_UNBOXED("popCount:1", x);
+
+  return BOX(__builtin_popcount ((unsigned) UNBOX(x)));
+}
+
+static void* copy_array (void **a, int n) {
+  void *r;
+
+  push_extra_root (a);
+  r = LmakeArray (BOX(n));
+  pop_extra_root (a);
+
+  return r;
+}
+
+extern void* LarrayInsert (void *a, int i, void *x) {
+  void **r;
+  int    n;
+
+  ASSERT_BOXED("arrayInsert:1", a);
+  ASSERT_UNBOXED("arrayInsert:2", i);
+
+  n = LEN(TO_DATA(a)->tag);
+  i = UNBOX(i);
+
+  if (i < 0 || i > n) failure ("arrayInsert: index out of bounds (index=%d, length=%d)\n", i, n);
+
+  __pre_gc ();
+
+  push_extra_root (&x);
+  r = (void**) copy_array (&a, n + 1);
+  pop_extra_root (&x);
+
+  memcpy (r, a, i * sizeof (void*));
+  r[i] = x;
+  memcpy (r + i + 1, (void**) a + i, (n - i) * sizeof (void*));
+
+  __post_gc ();
+
+  return r;
+}
+
+extern void* LarrayUpdate (void *a, int i, void *x) {
+  void **r;
+  int    n;
+
+  ASSERT_BOXED("arrayUpdate:1", a);
+  ASSERT_UNBOXED("arrayUpdate:2", i);
+
+  n = LEN(TO_DATA(a)->tag);
+  i = UNBOX(i);
+
+  if (i < 0 || i >= n) failure ("arrayUpdate: index out of bounds (index=%d, length=%d)\n", i, n);
+
+  __pre_gc ();
+
+  push_extra_root (&x);
+  r = (void**) copy_array (&a, n);
+  pop_extra_root (&x);
+
+  memcpy (r, a, n * sizeof (void*));
+  r[i] = x;
+
+  __post_gc ();
+
+  return r;
+}
+
+extern void* LarrayRemove (void *a, int i) {
+  void **r;
+  int    n;
+
+  ASSERT_BOXED("arrayRemove:1", a);
+  ASSERT_UNBOXED("arrayRemove:2", i);
+
+  n = LEN(TO_DATA(a)->tag);
+  i = UNBOX(i);
+
+  if (i < 0 || i >= n) failure ("arrayRemove: index out of bounds (index=%d, length=%d)\n", i, n);
+
+  __pre_gc ();
+
+  r = (void**) copy_array (&a, n - 1);
+
+  memcpy (r, a, i * sizeof (void*));
+  memcpy (r + i, (void**) a + i + 1, (n - i - 1) * sizeof (void*));
+
+  __post_gc ();
+
+  return r;
+}
+
 extern void* Bstring (void *p) {
   int   n = strlen (p);
   data *s = NULL;
@@ -987,13 +2099,14 @@ extern void* Bclosure (int bn, void *entry, ...) {
   register int * ebp asm ("ebp");
   size_t  *argss;
   data    *r; 
-  int     n = UNBOX(bn);
+  int     n = UNBOX(bn), mark;
   
   __pre_gc ();
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
   printf ("Bclosure: create n = %d\n", n); fflush(stdout);
 #endif
+  mark  = mark_extra_roots ();
   argss = (ebp + 12);
   for (i = 0; i<n; i++, argss++) {
     push_extra_root ((void**)argss);
@@ -1015,10 +2128,7 @@ extern void* Bclosure (int bn, void *entry, ...) {
 
   __post_gc();
 
-  argss--;
-  for (i = 0; i<n; i++, argss--) {
-    pop_extra_root ((void**)argss);
-  }
+  release_extra_roots (mark);
 
 #ifdef DEBUG_PRINT
   print_indent ();
@@ -1186,16 +2296,28 @@ extern void* Bsta (void *v, int i, void *x) {
     //    ASSERT_UNBOXED(".sta:2", i);
   
     if (TAG(TO_DATA(x)->tag) == STRING_TAG)((char*) x)[UNBOX(i)] = (char) UNBOX(v);
-    else ((int*) x)[UNBOX(i)] = (int) v;
+    else {
+      WRITE_BARRIER(&((void**) x)[UNBOX(i)], v);
+      ((int*) x)[UNBOX(i)] = (int) v;
+    }
 
     return v;
   }
 
+  WRITE_BARRIER(x, v);
   * (void**) x = v;
 
   return v;
 }
 
+/* Stores a value by a reference (STI, assignments to closure variables) */
+extern void* Bsti (void **x, void *v) {
+  WRITE_BARRIER(x, v);
+  *x = v;
+
+  return v;
+}
+
 static void fix_unboxed (char *s, va_list va) {
   size_t *p = (size_t*)va;
   int i = 0;
@@ -1251,8 +2373,8 @@ extern void* /*Lstrcat*/ Li__Infix_4343 (void *a, void *b) {
   
   d->tag = STRING_TAG | ((LEN(da->tag) + LEN(db->tag)) << 3);
 
-  strncpy (d->contents               , da->contents, LEN(da->tag));
-  strncpy (d->contents + LEN(da->tag), db->contents, LEN(db->tag));
+  memcpy (d->contents               , da->contents, LEN(da->tag));
+  memcpy (d->contents + LEN(da->tag), db->contents, LEN(db->tag));
   
   d->contents[LEN(da->tag) + LEN(db->tag)] = 0;
 
@@ -1261,6 +2383,149 @@ extern void* /*Lstrcat*/ Li__Infix_4343 (void *a, void *b) {
   return d->contents;
 }
 
+/* String builders: a builder is an array [length, store], where the store
+   is a string with some spare room (or 0), and the length is the number of
+   characters appended so far. When the store is exhausted it is replaced
+   with a string twice as large, thus appending takes amortized constant time */
+# define BUILDER_LENGTH 0
+# define BUILDER_STORE  1
+
+extern void* LstringBuilder () {
+  void **sb;
+
+  __pre_gc ();
+
+  sb = (void**) LmakeArray (BOX(2));
+  sb[BUILDER_LENGTH] = (void*) BOX(0);
+  sb[BUILDER_STORE]  = (void*) BOX(0);
+
+  __post_gc ();
+
+  return sb;
+}
+
+/* Makes room for n more characters in a builder (which is referenced from
+   a root); returns the position to write them to */
+static char* builder_reserve (void ***sb, int n) {
+  int   len   = UNBOX((int) (*sb)[BUILDER_LENGTH]);
+  void *store = (*sb)[BUILDER_STORE];
+  int   cap   = UNBOXED(store) ? 0 : LEN(TO_DATA(store)->tag);
+
+  if (len + n > cap) {
+    cap = cap < 16 ? 16 : 2 * cap;
+
+    if (cap < len + n) cap = len + n;
+
+    store = LmakeString (BOX(cap));
+
+    if (len) memcpy (store, (*sb)[BUILDER_STORE], len);
+
+    WRITE_BARRIER(&(*sb)[BUILDER_STORE], store);
+    (*sb)[BUILDER_STORE] = store;
+  }
+
+  return (char*) store + len;
+}
+
+/* Appends n characters, which are not in the heap; returns the
+   (possibly moved) builder */
+static void** builder_append (void **sb, char *s, int n) {
+  push_extra_root ((void**) &sb);
+  memcpy (builder_reserve (&sb, n), s, n);
+  pop_extra_root ((void**) &sb);
+
+  sb[BUILDER_LENGTH] = (void*) BOX(UNBOX((int) sb[BUILDER_LENGTH]) + n);
+
+  return sb;
+}
+
+extern void* LbuilderAppend (void *sb, void *s) {
+  char *dst;
+  int   n;
+
+  ASSERT_BOXED("builderAppend:1", sb);
+  ASSERT_STRING("builderAppend:2", s);
+
+  __pre_gc ();
+
+  n = LEN(TO_DATA(s)->tag);
+
+  push_extra_root (&s);
+  push_extra_root (&sb);
+  dst = builder_reserve ((void***) &sb, n);
+  pop_extra_root (&sb);
+  pop_extra_root (&s);
+
+  memcpy (dst, s, n);
+  ((void**) sb)[BUILDER_LENGTH] = (void*) BOX(UNBOX((int) ((void**) sb)[BUILDER_LENGTH]) + n);
+
+  __post_gc ();
+
+  return sb;
+}
+
+extern void* LbuilderAppendChar (void *sb, int c) {
+  char ch = (char) UNBOX(c);
+
+  ASSERT_BOXED("builderAppendChar:1", sb);
+  ASSERT_UNBOXED("builderAppendChar:2", c);
+
+  __pre_gc ();
+
+  sb = builder_append ((void**) sb, &ch, 1);
+
+  __post_gc ();
+
+  return sb;
+}
+
+extern void* LbuilderAppendInt (void *sb, int x) {
+  char buf[16];
+  int  n;
+
+  ASSERT_BOXED("builderAppendInt:1", sb);
+  ASSERT_UNBOXED("builderAppendInt:2", x);
+
+  __pre_gc ();
+
+  n = sprintf (buf, "%d", UNBOX(x));
+  sb = builder_append ((void**) sb, buf, n);
+
+  __post_gc ();
+
+  return sb;
+}
+
+extern int LbuilderLength (void *sb) {
+  ASSERT_BOXED("builderLength:1", sb);
+
+  return (int) ((void**) sb)[BUILDER_LENGTH];
+}
+
+/* Returns the contents of a builder as a string and empties the builder.
+   The store itself is returned: its header is truncated to the length of
+   the contents, and the remaining room is left unused until the next
+   collection */
+extern void* LbuilderContents (void *sb) {
+  void **b   = (void**) sb;
+  int    len = UNBOX((int) b[BUILDER_LENGTH]);
+  void  *store;
+
+  ASSERT_BOXED("builderContents:1", sb);
+
+  if (UNBOXED(b[BUILDER_STORE])) return Bstring ("");
+
+  store = b[BUILDER_STORE];
+
+  TO_DATA(store)->tag = STRING_TAG | (len << 3);
+  ((char*) store)[len] = 0;
+
+  b[BUILDER_LENGTH] = (void*) BOX(0);
+  b[BUILDER_STORE]  = (void*) BOX(0);
+
+  return store;
+}
+
 extern void* Lsprintf (char * fmt, ...) {
   va_list args;
   void *s;
@@ -1296,29 +2561,167 @@ extern void* LgetEnv (char *var) {
 
   __pre_gc ();
 
-  s = Bstring (e);
+  s = Bstring (e);
+
+  __post_gc ();
+
+  return s;
+}
+
+extern int Lsystem (char *cmd) {
+  return BOX (system (cmd));
+}
+
+extern void Lfprintf (FILE *f, char *s, ...) {
+  va_list args = (va_list) BOX (NULL);
+
+  ASSERT_BOXED("fprintf:1", f);
+  ASSERT_STRING("fprintf:2", s);  
+  
+  va_start    (args, s);
+  fix_unboxed (s, args);
+  
+  if (vfprintf (f, s, args) < 0) {
+    failure ("fprintf (...): %s\n", strerror (errno));
+  }
+}
+
+/* Batch I/O mode, selected by LAMA_BATCH environment variable: the standard
+   output and the files opened by fopen are fully buffered (and flushed on
+   fclose and at exit), "read" prints no prompt, and the standard input is
+   read in large chunks into io_input, from which integers and lines are
+   parsed directly */
+# define IO_BUFFER_SIZE (1 << 16)
+
+static int io_batch = 0;
+
+static struct {
+  char *buf;
+  int   pos;
+  int   end;
+  int   capacity;
+  int   eof;
+} io_input;
+
+static void init_io (void) {
+  if (getenv ("LAMA_BATCH") == NULL) return;
+
+  io_batch = 1;
+  setvbuf (stdout, NULL, _IOFBF, IO_BUFFER_SIZE);
+}
+
+/* Reads more input, keeping the unread part; the buffer grows if it is
+   full. Returns 0 at the end of input */
+static int io_fill (void) {
+  int n;
+  
+  if (io_input.eof) return 0;
+  
+  if (io_input.pos) {
+    memmove (io_input.buf, io_input.buf + io_input.pos, io_input.end - io_input.pos);
+    io_input.end -= io_input.pos;
+    io_input.pos  = 0;
+  }
+
+  if (io_input.end == io_input.capacity) {
+    io_input.capacity = io_input.capacity ? 2 * io_input.capacity : IO_BUFFER_SIZE;
+    io_input.buf      = (char*) realloc (io_input.buf, io_input.capacity);
+
+    if (io_input.buf == NULL) {
+      perror ("ERROR: io_fill: realloc failed");
+      exit   (1);
+    }
+  }
+
+  /* the standard output is flushed first, since the input may depend on it */
+  fflush (stdout);
+  
+  do n = read (0, io_input.buf + io_input.end, io_input.capacity - io_input.end);
+  while (n < 0 && errno == EINTR);
+
+  if (n < 0) failure ("read: %s\n", strerror (errno));
+  
+  if (n == 0) {
+    io_input.eof = 1;
+    return 0;
+  }
+
+  io_input.end += n;
+  return 1;
+}
+
+/* Returns the next input character without consuming it, or -1 */
+static inline int io_peek (void) {
+  if (io_input.pos == io_input.end && ! io_fill ()) return -1;
+
+  return (unsigned char) io_input.buf[io_input.pos];
+}
+
+/* Parses an integer in the same way as scanf ("%d") does; returns 0 if there
+   is no integer */
+static int io_read_int (void) {
+  int c, neg = 0;
+  unsigned int n = 0;
+
+  while ((c = io_peek ()) == ' ' || (c >= '\t' && c <= '\r')) io_input.pos++;
+
+  if (c == '-' || c == '+') {
+    neg = c == '-';
+    io_input.pos++;
+  }
+
+  while ((c = io_peek ()) >= '0' && c <= '9') {
+    n = 10 * n + (c - '0');
+    io_input.pos++;
+  }
+
+  return neg ? - (int) n : (int) n;
+}
+
+/* Reads a line (without the trailing newline); returns 0 at the end of
+   input */
+static void* io_read_line (void) {
+  char *nl;
+  int   scanned = 0, n;
+  void *s;
+
+  for (;;) {
+    nl = memchr (io_input.buf + io_input.pos + scanned, '\n', io_input.end - io_input.pos - scanned);
+
+    if (nl) break;
+
+    scanned = io_input.end - io_input.pos;
+
+    if (! io_fill ()) {
+      if (scanned == 0) return (void*) BOX(0);
+
+      nl = io_input.buf + io_input.end;
+      break;
+    }
+  }
+
+  n = nl - (io_input.buf + io_input.pos);
+  
+  __pre_gc ();
+
+  s = LmakeString (BOX(n));
+  memcpy (s, io_input.buf + io_input.pos, n);
 
   __post_gc ();
 
-  return s;
-}
+  io_input.pos += n + (nl < io_input.buf + io_input.end);
 
-extern int Lsystem (char *cmd) {
-  return BOX (system (cmd));
+  return s;
 }
 
-extern void Lfprintf (FILE *f, char *s, ...) {
-  va_list args = (va_list) BOX (NULL);
+/* Prints a value into a file in the same form as "string" does, but
+   without building the string */
+extern void Lfprint (FILE *f, void *v) {
+  ASSERT_BOXED("fprint:1", f);
 
-  ASSERT_BOXED("fprintf:1", f);
-  ASSERT_STRING("fprintf:2", s);  
-  
-  va_start    (args, s);
-  fix_unboxed (s, args);
-  
-  if (vfprintf (f, s, args) < 0) {
-    failure ("fprintf (...): %s\n", strerror (errno));
-  }
+  printFile = f;
+  printValue (v);
+  printFile = NULL;
 }
 
 extern void Lprintf (char *s, ...) {
@@ -1333,7 +2736,7 @@ extern void Lprintf (char *s, ...) {
     failure ("fprintf (...): %s\n", strerror (errno));
   }
 
-  fflush (stdout);
+  if (! io_batch) fflush (stdout);
 }
 
 extern FILE* Lfopen (char *f, char *m) {
@@ -1344,8 +2747,11 @@ extern FILE* Lfopen (char *f, char *m) {
 
   h = fopen (f, m);
   
-  if (h)
+  if (h) {
+    if (io_batch) setvbuf (h, NULL, _IOFBF, IO_BUFFER_SIZE);
+    
     return h;
+  }
 
   failure ("fopen (\"%s\", \"%s\"): %s, %s, %s\n", f, m, strerror (errno));
 }
@@ -1359,6 +2765,8 @@ extern void Lfclose (FILE *f) {
 extern void* LreadLine () {
   char *buf;
 
+  if (io_batch) return io_read_line ();
+
   if (scanf ("%m[^\n]", &buf) == 1) {
     void * s = Bstring (buf);
 
@@ -1407,7 +2815,9 @@ extern void Lfwrite (char *fname, char *contents) {
   f = fopen (fname, "w");
 
   if (f) {
-    if (fprintf (f, "%s", contents) < 0);
+    int n = LEN(TO_DATA(contents)->tag);
+    
+    if (fwrite (contents, 1, n, f) != n);
     else {
       fclose (f);
       return;
@@ -1417,6 +2827,149 @@ extern void Lfwrite (char *fname, char *contents) {
   failure ("fwrite (\"%s\"): %s\n", fname, strerror (errno));
 }
 
+/* External strings: a file mapped with fmap is a string which resides
+   outside the heap. It is preceded by a header in the last word of a page
+   of its own, followed by the (privately mapped, thus modifiable without
+   affecting the file) contents and at least one zero byte. The collector
+   never copies such strings; the mappings are kept until exit and are
+   registered in external_regions, so that the rest of the runtime treats
+   them as regular values */
+static struct {
+  size_t *bounds;   /* begin and end of each region */
+  int     size;
+  int     capacity;
+} external_regions;
+
+static int is_external_object (void *p) {
+  int i;
+
+  for (i = 0; i < external_regions.size; i += 2)
+    if (external_regions.bounds[i] < (size_t) p && (size_t) p < external_regions.bounds[i+1])
+      return 1;
+
+  return 0;
+}
+
+static void register_external_region (void *begin, size_t size) {
+  if (external_regions.size == external_regions.capacity) {
+    external_regions.capacity = external_regions.capacity ? 2 * external_regions.capacity : 16;
+    external_regions.bounds   = (size_t*) realloc (external_regions.bounds, external_regions.capacity * sizeof (size_t));
+
+    if (external_regions.bounds == NULL) {
+      perror ("ERROR: register_external_region: realloc failed");
+      exit   (1);
+    }
+  }
+
+  external_regions.bounds[external_regions.size++] = (size_t) begin;
+  external_regions.bounds[external_regions.size++] = (size_t) begin + size;
+}
+
+extern void* Lfmap (char *fname) {
+  size_t page = sysconf (_SC_PAGESIZE), size, total;
+  struct stat st;
+  char *base;
+  int fd;
+
+  ASSERT_STRING("fmap", fname);
+
+  fd = open (fname, O_RDONLY);
+
+  if (fd < 0 || fstat (fd, &st) < 0)
+    failure ("fmap (\"%s\"): %s\n", fname, strerror (errno));
+
+  size = st.st_size;
+  
+  if (st.st_size != size || size > LEN(0xFFFFFFFF))
+    failure ("fmap (\"%s\"): file is too large\n", fname);
+
+  total = page + (size + page) / page * page;
+  base  = mmap (NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (base == MAP_FAILED)
+    failure ("fmap (\"%s\"): %s\n", fname, strerror (errno));
+
+  if (size && mmap (base + page, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    failure ("fmap (\"%s\"): %s\n", fname, strerror (errno));
+
+  close (fd);
+
+  register_external_region (base, total);
+  
+  ((data*) (base + page - sizeof (int)))->tag = STRING_TAG | (size << 3);
+
+  return base + page;
+}
+
+/* Chunked access to files opened by fopen */
+extern void* LfreadChunk (FILE *f, int n) {
+  void *s;
+  int   m;
+
+  ASSERT_BOXED("freadChunk:1", f);
+  ASSERT_UNBOXED("freadChunk:2", n);
+
+  if (UNBOX(n) <= 0) failure ("freadChunk (...): invalid chunk size %d\n", UNBOX(n));
+
+  __pre_gc ();
+
+  s = LmakeString (n);
+  m = fread (s, 1, UNBOX(n), f);
+
+  __post_gc ();
+
+  if (m < UNBOX(n) && ferror (f))
+    failure ("freadChunk (...): %s\n", strerror (errno));
+
+  if (m == 0) return (void*) BOX(0);
+
+  /* a short chunk is truncated in place */
+  TO_DATA(s)->tag = STRING_TAG | (m << 3);
+  ((char*) s)[m] = 0;
+
+  return s;
+}
+
+extern void* LfreadLine (FILE *f) {
+  static char   *line     = NULL;
+  static size_t  capacity = 0;
+  ssize_t n;
+  void *s;
+
+  ASSERT_BOXED("freadLine", f);
+
+  n = getline (&line, &capacity, f);
+
+  if (n < 0) {
+    if (ferror (f)) failure ("freadLine (...): %s\n", strerror (errno));
+
+    return (void*) BOX(0);
+  }
+
+  if (n && line[n-1] == '\n') n--;
+
+  __pre_gc ();
+
+  s = LmakeString (BOX(n));
+  memcpy (s, line, n);
+
+  __post_gc ();
+
+  return s;
+}
+
+extern void LfwriteString (FILE *f, char *s) {
+  int n;
+
+  ASSERT_BOXED("fwriteString:1", f);
+  ASSERT_STRING("fwriteString:2", s);
+
+  n = LEN(TO_DATA(s)->tag);
+
+  if (fwrite (s, 1, n, f) != n)
+    failure ("fwriteString (...): %s\n", strerror (errno));
+}
+
 extern void* Lfst (void *v) {
   return Belem (v, BOX(0));  
 }
@@ -1437,6 +2990,8 @@ extern void* Ltl (void *v) {
 extern int Lread () {
   int result = BOX(0);
 
+  if (io_batch) return BOX(io_read_int ());
+  
   printf ("> "); 
   fflush (stdout);
   scanf  ("%d", &result);
@@ -1447,7 +3002,8 @@ extern int Lread () {
 /* Lwrite is an implementation of the "write" construct */
 extern int Lwrite (int n) {
   printf ("%d\n", UNBOX(n));
-  fflush (stdout);
+
+  if (! io_batch) fflush (stdout);
 
   return 0;
 }
@@ -1473,8 +3029,11 @@ extern int Ltime () {
 extern void set_args (int argc, char *argv[]) {
   data *a;
   int n = argc, *p = NULL;
+  void *s;
   int i;
   
+  init_io ();
+  
   __pre_gc ();
 
 #ifdef DEBUG_PRINT
@@ -1493,7 +3052,8 @@ extern void set_args (int argc, char *argv[]) {
     print_indent ();
     printf ("set_args: iteration %i %p %p ->\n", i, &p, p); fflush(stdout);
 #endif
-    ((int*)p) [i] = (int) Bstring (argv[i]);
+    s = Bstring (argv[i]);
+    Bsti ((void**) &p[i], s);
 #ifdef DEBUG_PRINT
     print_indent ();
     printf ("set_args: iteration %i <- %p %p\n", i, &p, p); fflush(stdout);
@@ -1514,14 +3074,45 @@ extern void set_args (int argc, char *argv[]) {
 
 /* GC starts here */
 
+/* Nursery size (in words); from_space always keeps this amount of words as a reserve,
+   thus the live data of both generations fits into to_space during a major collection */
+# define NURSERY_SIZE (256 * 1024)
+
 static int enable_GC = 1;
 
+static void      minor_gc      (void);
+static void*     gc            (size_t size);
+static void      init_to_space (void);
+static long long gc_clock      (void);
+static void      gc_pause      (long long start);
+
 extern void LenableGC () {
-  enable_GC = 1;
+  enable_GC   = 1;
+  nursery.end = nursery.begin + nursery.size;
 }
 
+/* Objects do not move after this call: the nursery is evacuated once,
+   and all subsequent allocations go directly into the old generation */
 extern void LdisableGC () {
-  enable_GC = 0;
+  __pre_gc ();
+
+  /* the same condition as in alloc: a minor collection needs the room for
+     the whole nursery in the old generation */
+  if (enable_GC) {
+    if (from_space.current + 2 * NURSERY_SIZE < from_space.end) minor_gc ();
+    else {
+      long long t = gc_clock ();
+
+      init_to_space ();
+      gc (0);
+      gc_pause (t);
+    }
+  }
+  
+  enable_GC   = 0;
+  nursery.end = nursery.begin;
+
+  __post_gc ();
 }
 
 extern const size_t __start_custom_data, __stop_custom_data;
@@ -1537,7 +3128,7 @@ void __gc_init_subst () {}
 
 # endif
 
-extern void __gc_root_scan_stack ();
+extern void __gc_root_scan_stack (size_t *from);
 
 /* ======================================== */
 /*           Mark-and-copy                  */
@@ -1545,6 +3136,30 @@ extern void __gc_root_scan_stack ();
 
 //static size_t SPACE_SIZE = 16;
 static size_t SPACE_SIZE = 256 * 1024 * 1024;
+
+/* Heap sizing policy (all sizes are in words, per semispace), configured in __init
+   from the environment:
+
+     LAMA_HEAP_SIZE       --- initial size in bytes (suffixes K, M, G are allowed);
+     LAMA_HEAP_MAX        --- hard limit in bytes; exceeding it is an "out of memory" failure;
+     LAMA_HEAP_GROWTH     --- growth factor (> 1, may be fractional);
+     LAMA_HEAP_LIVE_RATIO --- target live ratio in percents: the heap grows when live data
+                              after a collection occupy more than this share of it;
+     LAMA_GC_THREADS      --- number of threads for major collections (1 by default)
+*/
+static size_t HEAP_MAX        = 0;
+static double HEAP_GROWTH     = 2.0;
+static int    HEAP_LIVE_RATIO = 0;
+
+# define MAX_GC_THREADS 64
+static int    GC_THREADS      = 1;
+
+/* The smallest heap keeps room for both the nursery reserve and some old data */
+# define MIN_SPACE_SIZE (4 * NURSERY_SIZE)
+
+# ifdef GC_RELEASE_PAGES
+#   define GC_PAGE_SIZE 4096
+# endif
 // static size_t SPACE_SIZE = 128;
 // static size_t SPACE_SIZE = 1024 * 1024;
 
@@ -1554,18 +3169,23 @@ static int free_pool (pool * p) {
   p->size    = 0;
   p->end     = NULL;
   p->current = NULL;
-  return munmap((void *)a, b);
+  return munmap((void *)a, b * sizeof(size_t));
 }
 
-static void init_to_space (int flag) {
+/* Both semispaces stay mapped during the whole run and only swap their roles
+   after each collection; to_space is remapped only when the heap size changes */
+static void init_to_space (void) {
   size_t space_size = 0;
-  if (flag) SPACE_SIZE = SPACE_SIZE << 1;
+  if (to_space.begin != NULL && to_space.size == SPACE_SIZE) {
+    to_space.current = to_space.begin;
+    return;
+  }
+  if (to_space.begin != NULL) free_pool (&to_space);
   space_size     = SPACE_SIZE * sizeof(size_t);
   to_space.begin = mmap (NULL, space_size, PROT_READ | PROT_WRITE,
 			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
   if (to_space.begin == MAP_FAILED) {
-    perror ("EROOR: init_to_space: mmap failed\n");
-    exit   (1);
+    failure ("out of memory (can not map a heap of %zu bytes)\n", space_size);
   }
   to_space.current = to_space.begin;
   to_space.end     = to_space.begin + SPACE_SIZE;
@@ -1573,19 +3193,27 @@ static void init_to_space (int flag) {
 }
 
 static void gc_swap_spaces (void) {
+  pool idle = from_space;
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
   printf ("gc_swap_spaces\n"); fflush (stdout);
 #endif
-  free_pool (&from_space);
   from_space.begin   = to_space.begin;
   from_space.current = current;
   from_space.end     = to_space.end;
   from_space.size    = to_space.size;
-  to_space.begin   = NULL;
-  to_space.current = NULL;
-  to_space.end     = NULL;
-  to_space.size    = 0;
+  to_space           = idle;
+  to_space.current   = to_space.begin;
+#ifdef GC_RELEASE_PAGES
+  /* Return the pages of the idle semispace above the high-water mark (twice
+     the live data) to the system; they are faulted in again on demand */
+  {
+    size_t *mark = to_space.begin + 2 * (current - from_space.begin);
+    mark = (size_t*) (((size_t) mark + GC_PAGE_SIZE - 1) & ~(GC_PAGE_SIZE - 1));
+    if (mark < idle.current)
+      madvise (mark, (idle.current - mark) * sizeof(size_t), MADV_DONTNEED);
+  }
+#endif
 #ifdef DEBUG_PRINT
   indent--;
 #endif
@@ -1593,8 +3221,10 @@ static void gc_swap_spaces (void) {
 
 # define IS_VALID_HEAP_POINTER(p)\
   (!UNBOXED(p) &&		 \
-   (size_t)from_space.begin <= (size_t)p &&	 \
-   (size_t)from_space.end   >  (size_t)p)
+   (((size_t)from_space.begin <= (size_t)p &&	 \
+     (size_t)from_space.end   >  (size_t)p) ||	 \
+    ((size_t)nursery.begin    <= (size_t)p &&	 \
+     (size_t)nursery.end      >  (size_t)p)))
 
 # define IN_PASSIVE_SPACE(p)	\
   ((size_t)to_space.begin <= (size_t)p	&&	\
@@ -1603,58 +3233,93 @@ static void gc_swap_spaces (void) {
 # define IS_FORWARD_PTR(p)			\
   (!UNBOXED(p) && IN_PASSIVE_SPACE(p))
 
+/* Checks if p is a reference to a value, which is either in the heap, or an
+   external string */
 int is_valid_heap_pointer (void *p)  {
-  return IS_VALID_HEAP_POINTER(p);
+  return IS_VALID_HEAP_POINTER(p) || (!UNBOXED(p) && is_external_object (p));
 }
 
 extern size_t * gc_copy (size_t *obj);
 
-static void copy_elements (size_t *where, size_t *from, int len) {
-  int    i = 0;
-  void * p = NULL;
-#ifdef DEBUG_PRINT
-  indent++; print_indent ();
-  printf ("copy_elements: start; len = %d\n", len); fflush (stdout);
-#endif
-  for (i = 0; i < len; i++) {
-    size_t elem = from[i];
-    if (!IS_VALID_HEAP_POINTER(elem)) {
-      *where = elem;
-      where++;
-#ifdef DEBUG_PRINT
-      print_indent ();	
-      printf ("copy_elements: copy NON ptr: %zu %p \n", elem, elem); fflush (stdout);
-#endif
+/* Objects are evacuated breadth-first (Cheney's algorithm): gc_copy copies
+   an object shallowly, and gc_scan_to_space then fixes the fields of all
+   copied objects, moving the scan pointer from to_space.begin to current.
+   As the first word of an S-expression is an arbitrary tag hash, the starts
+   of S-expressions in to_space are marked in a separate bitmap */
+static size_t *sexp_starts      = NULL;
+static size_t  sexp_starts_size = 0;
+
+# define SEXP_START_BIT(p)  ((size_t)((size_t*)(p) - to_space.begin))
+# define MARK_SEXP_START(p) (sexp_starts [SEXP_START_BIT(p) / WORD_SIZE] |= (size_t) 1 << (SEXP_START_BIT(p) % WORD_SIZE))
+# define IS_SEXP_START(p)   (sexp_starts [SEXP_START_BIT(p) / WORD_SIZE] &  (size_t) 1 << (SEXP_START_BIT(p) % WORD_SIZE))
+
+static void init_sexp_starts (void) {
+  size_t need = to_space.size / WORD_SIZE + 1;
+
+  if (need <= sexp_starts_size) return;
+
+  free (sexp_starts);
+  sexp_starts      = (size_t*) calloc (need, sizeof(size_t));
+  sexp_starts_size = need;
+  
+  if (sexp_starts == NULL) {
+    perror ("ERROR: init_sexp_starts: calloc failed\n");
+    exit   (1);
+  }
+}
+
+static void clear_sexp_starts (void) {
+  memset (sexp_starts, 0, (SEXP_START_BIT(current) / WORD_SIZE + 1) * sizeof(size_t));
+}
+
+static void gc_scan_to_space (void) {
+  size_t *scan = to_space.begin, *fields;
+  int     len, i;
+
+  while (scan < current) {
+    if (IS_SEXP_START(scan)) {
+      len    = LEN(scan[1]);
+      fields = scan + 2;
+    }
+    else if (TAG(*scan) == STRING_TAG) {
+      scan += (LEN(*scan) + sizeof(int)) / sizeof(size_t) + 1;
+      continue;
     }
     else {
-#ifdef DEBUG_PRINT
-      print_indent ();	
-      printf ("copy_elements: fix element: %p -> %p\n", elem, *where);
-      fflush (stdout);
-#endif
-      p = gc_copy ((size_t*) elem);
-      *where = (size_t) p;
-      where ++;
+      len    = LEN(*scan);
+      fields = scan + 1;
     }
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf ("copy_elements: iteration end: where = %p, *where = %p, i = %d, \
-             len = %d\n", where, *where, i, len); fflush (stdout);
-#endif
 
+    for (i = 0; i < len; i++)
+      if (IS_VALID_HEAP_POINTER(fields[i])) fields[i] = (size_t) gc_copy ((size_t*) fields[i]);
+
+    scan = fields + len;
+  }
+}
+
+/* Returns a space size of at least need words according to the growth policy */
+static size_t grown_space_size (size_t need, int hard) {
+  size_t limit = HEAP_MAX ? HEAP_MAX : SIZE_MAX / sizeof(size_t);
+  double size  = SPACE_SIZE;
+  
+  while (size < need && size < limit) {
+    size = size * HEAP_GROWTH;
+    if (size < SPACE_SIZE + 1) size = SPACE_SIZE + 1;
+  }
+  
+  if (size > limit) size = limit;
+  
+  if (hard && size < need) {
+    failure ("out of memory (heap limit of %zu bytes exceeded)\n", limit * sizeof(size_t));
   }
-#ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("\tcopy_elements: end\n"); fflush (stdout);
-  indent--;
-#endif
 
+  return (size_t) size;
 }
 
-static int extend_spaces (void) {
+static int extend_spaces (size_t new_size) {
   void *p = (void *) BOX (NULL);
-  size_t old_space_size = SPACE_SIZE        * sizeof(size_t),
-         new_space_size = (SPACE_SIZE << 1) * sizeof(size_t);
+  size_t old_space_size = to_space.size * sizeof(size_t),
+         new_space_size = new_size      * sizeof(size_t);
   p = mremap(to_space.begin, old_space_size, new_space_size, 0);
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
@@ -1672,8 +3337,8 @@ static int extend_spaces (void) {
   fflush (stdout);
   indent--;
 #endif
-  to_space.end    += SPACE_SIZE;
-  SPACE_SIZE      =  SPACE_SIZE << 1;
+  SPACE_SIZE      =  new_size;
+  to_space.end    =  to_space.begin + SPACE_SIZE;
   to_space.size   =  SPACE_SIZE;
   return 0;
 }
@@ -1739,7 +3404,7 @@ extern size_t * gc_copy (size_t *obj) {
       *copy = d->tag;
       copy++;
       d->tag = (int) copy;
-      copy_elements (copy, obj, i);
+      memcpy (copy, obj, i * sizeof(size_t));
       break;
     
     case ARRAY_TAG:
@@ -1752,7 +3417,7 @@ extern size_t * gc_copy (size_t *obj) {
       copy++;
       i = LEN(d->tag);
       d->tag = (int) copy;
-      copy_elements (copy, obj, i);
+      memcpy (copy, obj, i * sizeof(size_t));
       break;
 
     case STRING_TAG:
@@ -1781,79 +3446,358 @@ extern size_t * gc_copy (size_t *obj) {
 #endif
       i = LEN(s->contents.tag);
       current += i + 2;
+      MARK_SEXP_START(copy);
       *copy = s->tag;
       copy++;
       *copy = d->tag;
       copy++;
       d->tag = (int) copy;
-      copy_elements (copy, obj, i);
+      memcpy (copy, obj, i * sizeof(size_t));
       break;
 
-  default:
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf ("ERROR: gc_copy: weird tag: %p", TAG(d->tag)); fflush (stdout);
-    indent--;
-#endif
-    perror ("ERROR: gc_copy: weird tag");
-    exit (1);
-    return (obj);
+  default:
+#ifdef DEBUG_PRINT
+    print_indent ();
+    printf ("ERROR: gc_copy: weird tag: %p", TAG(d->tag)); fflush (stdout);
+    indent--;
+#endif
+    perror ("ERROR: gc_copy: weird tag");
+    exit (1);
+    return (obj);
+  }
+#ifdef DEBUG_PRINT
+  print_indent ();
+  printf ("gc_copy: %p(%p) -> %p (%p); new-current = %p\n",
+	  obj, objj, copy, newobjj, current);
+  fflush (stdout);
+  indent--;
+#endif
+  return copy;
+}
+
+static int      minor_mode = 0;
+static size_t * gc_promote (size_t *obj);
+static void     gc_collect_root (size_t **root);
+static int      collect_roots = 0;
+
+extern void gc_test_and_copy_root (size_t ** root) {
+#ifdef DEBUG_PRINT
+    indent++;
+#endif
+  if (minor_mode) {
+    if (IS_YOUNG(*root)) *root = gc_promote (*root);
+  }
+  else if (collect_roots) {
+    if (IS_VALID_HEAP_POINTER(*root)) gc_collect_root (root);
+  }
+  else if (IS_VALID_HEAP_POINTER(*root)) {
+#ifdef DEBUG_PRINT
+    print_indent ();
+    printf ("gc_test_and_copy_root: root %p top=%p bot=%p  *root %p \n", root, __gc_stack_top, __gc_stack_bottom, *root);
+    fflush (stdout);
+#endif
+    *root = gc_copy (*root);
+  }
+#ifdef DEBUG_PRINT
+  else {
+    print_indent ();
+    printf ("gc_test_and_copy_root: INVALID HEAP POINTER root %p  *root %p\n", root, *root);
+    fflush (stdout);
+  }
+  indent--;
+#endif
+}
+
+extern void gc_root_scan_data (void) {
+  size_t * p = (size_t*)&__start_custom_data;
+  while  (p < (size_t*)&__stop_custom_data) {
+    gc_test_and_copy_root ((size_t**)p);
+    p++;
+  }
+}
+
+/* Stack maps: the compiler emits one for each call site into the section
+   lama_stackmaps; a map describes the frame of the caller at this site */
+typedef struct {
+  size_t ra;       /* return address                                    */
+  int    closure;  /* the closure is saved in the frame at 4(%ebp)      */
+  int    nlocals;  /* number of local variables                         */
+  int    lsize;    /* size of the local area of the frame (in bytes)    */
+  int    npushed;  /* number of words pushed right before the call      */
+  int    nslots;   /* number of live symbolic stack slots               */
+  int    slots[0]; /* indices of live symbolic stack slots              */
+} stack_map;
+
+extern int __start_lama_stackmaps[] __attribute__((weak));
+extern int __stop_lama_stackmaps [] __attribute__((weak));
+
+static stack_map **stack_maps   = NULL;
+static int         stack_maps_n = -1;
+
+static int compare_stack_maps (const void *p, const void *q) {
+  size_t a = (*(stack_map**) p)->ra, b = (*(stack_map**) q)->ra;
+  
+  return a < b ? -1 : a > b;
+}
+
+static void init_stack_maps (void) {
+  int *p = __start_lama_stackmaps, i = 0;
+
+  stack_maps_n = 0;
+  
+  for (; p && p < __stop_lama_stackmaps; p += 6 + ((stack_map*) p)->nslots) stack_maps_n++;
+
+  if (stack_maps_n == 0) return;
+  
+  stack_maps = (stack_map**) malloc (stack_maps_n * sizeof (stack_map*));
+  if (stack_maps == NULL) {
+    perror ("ERROR: init_stack_maps: malloc failed\n");
+    exit   (1);
+  }
+  
+  for (p = __start_lama_stackmaps; p < __stop_lama_stackmaps; p += 6 + ((stack_map*) p)->nslots)
+    stack_maps [i++] = (stack_map*) p;
+
+  qsort (stack_maps, stack_maps_n, sizeof (stack_map*), compare_stack_maps);
+}
+
+static stack_map* find_stack_map (size_t ra) {
+  int l = 0, r = stack_maps_n - 1;
+
+  while (l <= r) {
+    int m = (l + r) / 2;
+    
+    if      (stack_maps[m]->ra == ra) return stack_maps[m];
+    else if (stack_maps[m]->ra <  ra) l = m + 1;
+    else r = m - 1;
+  }
+
+  return NULL;
+}
+
+/* Walks the frames of compiled code using their stack maps; the remainder of the
+   stack, starting from the first frame without a map, is scanned conservatively */
+static void gc_root_scan_stack (void) {
+  size_t *fp = (size_t*) __gc_stack_top, *frame, *pushed, ra;
+  int     i;
+
+  if (stack_maps_n < 0) init_stack_maps ();
+
+  if (stack_maps_n == 0) {
+    __gc_root_scan_stack (fp);
+    return;
+  }
+  
+  ra = fp[1];
+  
+  while (fp + 1 < (size_t*) __gc_stack_bottom) {
+    stack_map *m = find_stack_map (ra);
+
+    if (m == NULL) {
+      __gc_root_scan_stack (fp);
+      return;
+    }
+
+    frame  = (size_t*) fp[0];
+    pushed = (size_t*) ((char*) frame - m->lsize) - m->npushed;
+
+    if (m->closure) gc_test_and_copy_root ((size_t**) &frame[1]);
+
+    for (i = 0; i < m->nlocals; i++)
+      gc_test_and_copy_root ((size_t**) &frame[-1-i]);
+
+    for (i = 0; i < m->nslots; i++)
+      gc_test_and_copy_root ((size_t**) &frame[-1-m->slots[i]]);
+
+    for (i = 0; i < m->npushed; i++)
+      gc_test_and_copy_root ((size_t**) &pushed[i]);
+
+    ra = frame[1 + m->closure];
+    fp = frame;
+  }
+}
+
+/* Objects allocated in the nursery are accounted for when it is emptied */
+# define GC_ALLOCATED (gc_stats.allocated + (nursery.current - nursery.begin))
+
+static long long gc_clock (void) {
+  struct timespec t;
+  
+  clock_gettime (CLOCK_MONOTONIC, &t);
+
+  return (long long) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static void gc_pause (long long start) {
+  long long t = gc_clock () - start;
+
+  gc_stats.pause_total += t;
+  if (t > gc_stats.pause_max) gc_stats.pause_max = t;
+}
+
+static void print_gc_stats (void) {
+  fprintf (stderr,
+	   "GC statistics:\n"
+	   "  collections         : %d minor, %d major\n"
+	   "  allocated           : %llu bytes\n"
+	   "  copied              : %llu bytes\n"
+	   "  survived last GC    : %zu words\n"
+	   "  pause time          : %lld us total, %lld us max\n"
+	   "  heap growth events  : %d (heap size %zu bytes)\n"
+	   "  extra roots         : %d at most\n",
+	   gc_stats.minor, gc_stats.major,
+	   GC_ALLOCATED * sizeof(size_t),
+	   gc_stats.copied * sizeof(size_t),
+	   gc_stats.survived,
+	   gc_stats.pause_total, gc_stats.pause_max,
+	   gc_stats.growths, SPACE_SIZE * sizeof(size_t),
+	   gc_stats.roots_max);
+}
+
+/* Returns an array of GC counters:
+     [minor collections, major collections, kilobytes allocated, kilobytes copied,
+      words survived the last collection, total pause (us), maximal pause (us),
+      heap growth events, extra roots high-water mark] */
+extern void* LgcStats () {
+  int   stats [] = {gc_stats.minor, gc_stats.major,
+		    (int) (GC_ALLOCATED * sizeof(size_t) >> 10),
+		    (int) (gc_stats.copied * sizeof(size_t) >> 10),
+		    (int) gc_stats.survived,
+		    (int) gc_stats.pause_total, (int) gc_stats.pause_max,
+		    gc_stats.growths, gc_stats.roots_max};
+  int   n = sizeof (stats) / sizeof (int), i;
+  int  *r;
+
+  __pre_gc ();
+  
+  r = (int*) LmakeArray (BOX(n));
+
+  for (i = 0; i < n; i++) r[i] = BOX(stats[i]);
+  
+  __post_gc ();
+  
+  return r;
+}
+
+static inline void init_extra_roots (void) {
+  extra_roots.current_free = 0;
+}
+
+/* Remembered set: addresses of old generation slots which may point into the nursery */
+static struct {
+  void ***slots;
+  int     size;
+  int     capacity;
+} remembered;
+
+/* Gray objects (promoted, but not yet scanned) of a minor collection; as each
+   object with fields occupies at least two words the capacity is bounded */
+static size_t **gray;
+static int      gray_size;
+
+static void gc_remember (void **p) {
+  if (remembered.size == remembered.capacity) {
+    remembered.capacity = remembered.capacity ? remembered.capacity << 1 : 1024;
+    remembered.slots    = (void***) realloc (remembered.slots, remembered.capacity * sizeof (void**));
+
+    if (remembered.slots == NULL) {
+      perror ("ERROR: gc_remember: realloc failed\n");
+      exit   (1);
+    }
   }
-#ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("gc_copy: %p(%p) -> %p (%p); new-current = %p\n",
-	  obj, objj, copy, newobjj, current);
-  fflush (stdout);
-  indent--;
-#endif
-  return copy;
+  
+  remembered.slots [remembered.size++] = p;
 }
 
-extern void gc_test_and_copy_root (size_t ** root) {
-#ifdef DEBUG_PRINT
-    indent++;
-#endif
-  if (IS_VALID_HEAP_POINTER(*root)) {
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf ("gc_test_and_copy_root: root %p top=%p bot=%p  *root %p \n", root, __gc_stack_top, __gc_stack_bottom, *root);
-    fflush (stdout);
-#endif
-    *root = gc_copy (*root);
+static void init_nursery (void) {
+  nursery.begin = mmap (NULL, NURSERY_SIZE * sizeof(size_t), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  if (nursery.begin == MAP_FAILED) {
+    perror ("ERROR: init_nursery: mmap failed\n");
+    exit   (1);
   }
-#ifdef DEBUG_PRINT
-  else {
-    print_indent ();
-    printf ("gc_test_and_copy_root: INVALID HEAP POINTER root %p  *root %p\n", root, *root);
-    fflush (stdout);
+  nursery.current = nursery.begin;
+  nursery.end     = nursery.begin + NURSERY_SIZE;
+  nursery.size    = NURSERY_SIZE;
+
+  gray = (size_t**) malloc (NURSERY_SIZE / 2 * sizeof (size_t*));
+  if (gray == NULL) {
+    perror ("ERROR: init_nursery: malloc failed\n");
+    exit   (1);
   }
-  indent--;
-#endif
 }
 
-extern void gc_root_scan_data (void) {
-  size_t * p = (size_t*)&__start_custom_data;
-  while  (p < (size_t*)&__stop_custom_data) {
-    gc_test_and_copy_root ((size_t**)p);
-    p++;
+/* Reads a size in bytes (with an optional K/M/G suffix) and returns it in words */
+static size_t env_size (char *name, size_t dflt) {
+  char *e = getenv (name), *end;
+  unsigned long long n;
+
+  if (e == NULL) return dflt;
+
+  n = strtoull (e, &end, 10);
+  
+  switch (*end) {
+  case 'k': case 'K': n <<= 10; end++; break;
+  case 'm': case 'M': n <<= 20; end++; break;
+  case 'g': case 'G': n <<= 30; end++; break;
+  default : break;
+  }
+
+  if (end == e || *end || n / sizeof(size_t) == 0 || n / sizeof(size_t) > SIZE_MAX / sizeof(size_t)) {
+    failure ("invalid value of %s: \"%s\"\n", name, e);
   }
+
+  return n / sizeof(size_t);
 }
 
-static inline void init_extra_roots (void) {
-  extra_roots.current_free = 0;
+static void init_heap_policy (void) {
+  char *e, *end;
+  
+  SPACE_SIZE = env_size ("LAMA_HEAP_SIZE", SPACE_SIZE);
+  HEAP_MAX   = env_size ("LAMA_HEAP_MAX" , HEAP_MAX);
+
+  if ((e = getenv ("LAMA_GC_THREADS")) != NULL) {
+    GC_THREADS = strtol (e, &end, 10);
+    if (end == e || *end || GC_THREADS <= 0 || GC_THREADS > MAX_GC_THREADS) {
+      failure ("invalid value of LAMA_GC_THREADS: \"%s\"\n", e);
+    }
+  }
+
+  if ((e = getenv ("LAMA_HEAP_GROWTH")) != NULL) {
+    HEAP_GROWTH = strtod (e, &end);
+    if (end == e || *end || !(HEAP_GROWTH > 1.0)) {
+      failure ("invalid value of LAMA_HEAP_GROWTH: \"%s\"\n", e);
+    }
+  }
+
+  if ((e = getenv ("LAMA_HEAP_LIVE_RATIO")) != NULL) {
+    HEAP_LIVE_RATIO = strtol (e, &end, 10);
+    if (end == e || *end || HEAP_LIVE_RATIO <= 0 || HEAP_LIVE_RATIO > 100) {
+      failure ("invalid value of LAMA_HEAP_LIVE_RATIO: \"%s\"\n", e);
+    }
+  }
+
+  if (SPACE_SIZE < MIN_SPACE_SIZE) SPACE_SIZE = MIN_SPACE_SIZE;
+  
+  if (HEAP_MAX) {
+    if (HEAP_MAX < MIN_SPACE_SIZE) HEAP_MAX = MIN_SPACE_SIZE;
+    if (SPACE_SIZE > HEAP_MAX) SPACE_SIZE = HEAP_MAX;
+  }
 }
 
 extern void __init (void) {
-  size_t space_size = SPACE_SIZE * sizeof(size_t);
+  size_t space_size = 0;
 
   srandom (time (NULL));
+
+  init_heap_policy ();
+  space_size = SPACE_SIZE * sizeof(size_t);
   
   from_space.begin = mmap (NULL, space_size, PROT_READ | PROT_WRITE,
     			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
   to_space.begin   = NULL;
-  if (to_space.begin == MAP_FAILED) {
-    perror ("EROOR: init_pool: mmap failed\n");
-    exit   (1);
+  if (from_space.begin == MAP_FAILED) {
+    failure ("out of memory (can not map a heap of %zu bytes)\n", space_size);
   }
   from_space.current = from_space.begin;
   from_space.end     = from_space.begin + SPACE_SIZE;
@@ -1861,15 +3805,408 @@ extern void __init (void) {
   to_space.current   = NULL;
   to_space.end       = NULL;
   to_space.size      = 0;
+  init_to_space ();
+  init_nursery ();
   init_extra_roots ();
+
+  if (getenv ("LAMA_GC_STATS")) atexit (print_gc_stats);
 }
 
-static void* gc (size_t size) {
-  if (! enable_GC) {
-    Lfailure ("GC disabled");
+/* Copies a young object into the old generation; returns the new address */
+static size_t * gc_promote (size_t *obj) {
+  data   *d = TO_DATA(obj);
+  size_t *from, *copy;
+  size_t  words;
+
+  if ((size_t) from_space.begin <= (size_t) d->tag && (size_t) d->tag < (size_t) from_space.end)
+    return (size_t*) d->tag;
+
+  switch (TAG(d->tag)) {
+  case CLOSURE_TAG:
+  case ARRAY_TAG:
+    from  = (size_t*) d;
+    words = LEN(d->tag) + 1;
+    break;
+
+  case STRING_TAG:
+    from  = (size_t*) d;
+    words = (LEN(d->tag) + sizeof(int)) / sizeof(size_t) + 1;
+    break;
+
+  case SEXP_TAG:
+    from  = (size_t*) TO_SEXP(obj);
+    words = LEN(d->tag) + 2;
+    break;
+
+  default:
+    perror ("ERROR: gc_promote: weird tag");
+    exit (1);
   }
+
+  copy = from_space.current;
+  from_space.current += words;
+  memcpy (copy, from, words * sizeof(size_t));
+
+  copy  += (obj - from);
+  d->tag = (int) copy;
   
-  current = to_space.begin;
+  if (TAG(TO_DATA(copy)->tag) != STRING_TAG && LEN(TO_DATA(copy)->tag))
+    gray [gray_size++] = copy;
+
+  return copy;
+}
+
+/* Minor collection: promotes all live young objects; the old generation
+   is required to have at least NURSERY_SIZE free words */
+static void minor_gc (void) {
+  long long t     = gc_clock ();
+  size_t   *start = from_space.current;
+  int       i;
+  
+  minor_mode = 1;
+  gray_size  = 0;
+  
+  gc_root_scan_data ();
+  gc_root_scan_stack ();
+
+  for (i = 0; i < extra_roots.current_free; i++)
+    gc_test_and_copy_root ((size_t**)extra_roots.roots[i]);
+
+  for (i = 0; i < remembered.size; i++)
+    gc_test_and_copy_root ((size_t**)remembered.slots[i]);
+
+  while (gray_size) {
+    size_t *obj = gray [--gray_size];
+    int     len = LEN(TO_DATA(obj)->tag);
+
+    for (i = 0; i < len; i++)
+      if (IS_YOUNG(obj[i])) obj[i] = (size_t) gc_promote ((size_t*) obj[i]);
+  }
+
+  gc_stats.allocated += nursery.current - nursery.begin;
+  nursery.current     = nursery.begin;
+  remembered.size     = 0;
+  minor_mode          = 0;
+
+  gc_stats.minor++;
+  gc_stats.survived  = from_space.current - start;
+  gc_stats.copied   += gc_stats.survived;
+  gc_pause (t);
+}
+
+/* Parallel evacuation (LAMA_GC_THREADS > 1). The roots are collected first
+   and distributed among the threads; each thread copies objects into its
+   own chunk of to_space, installs forwarding pointers with CAS and keeps
+   the copied but not yet scanned objects on its gray stack, from which the
+   other threads steal when idle. If to_space runs out (the chunks waste a
+   part of it), the evacuation is undone and the sequential collector runs
+   instead. Minor collections stay sequential */
+# define GC_CHUNK 4096
+
+typedef struct {
+  int             id;
+  size_t         *top;     /* allocation buffer in to_space */
+  size_t         *limit;
+  size_t        **gray;    /* gray stack                    */
+  volatile int    size;
+  int             capacity;
+  pthread_mutex_t lock;
+  data          **forwarded; /* objects forwarded by the thread    */
+  int             forwarded_size;
+  int             forwarded_capacity;
+} gc_thread;
+
+static gc_thread     gc_threads [MAX_GC_THREADS];
+static size_t     ***gc_roots;
+static int           gc_roots_size, gc_roots_capacity;
+static volatile int  gc_active;
+static volatile int  gc_overflow;
+
+static void gc_collect_root (size_t **root) {
+  if (gc_roots_size == gc_roots_capacity) {
+    gc_roots_capacity = gc_roots_capacity ? gc_roots_capacity << 1 : 1024;
+    gc_roots = (size_t***) realloc (gc_roots, gc_roots_capacity * sizeof (size_t**));
+    if (gc_roots == NULL) {
+      perror ("ERROR: gc_collect_root: realloc failed\n");
+      exit   (1);
+    }
+  }
+
+  gc_roots [gc_roots_size++] = root;
+}
+
+/* Makes a gap in to_space look like an object, so the space stays parsable */
+static void gc_fill (size_t *p, size_t *q) {
+  if (p == q) return;
+  if (q - p == 1) *p = ARRAY_TAG;
+  else *p = STRING_TAG | (((q - p - 2) * sizeof(size_t)) << 3);
+}
+
+/* Takes words from the shared part of to_space; returns NULL and raises
+   gc_overflow if to_space is exhausted */
+static size_t * gc_shared_alloc (size_t words) {
+  size_t *p = (size_t*) __sync_fetch_and_add ((size_t*) &current, words * sizeof(size_t));
+
+  if (p + words > to_space.end) {
+    gc_overflow = 1;
+    return NULL;
+  }
+
+  return p;
+}
+
+static size_t * gc_thread_alloc (gc_thread *t, size_t words) {
+  size_t *p;
+  
+  if (t->top + words <= t->limit) {
+    p = t->top;
+    t->top += words;
+    return p;
+  }
+
+  if (words > GC_CHUNK / 8) return gc_shared_alloc (words);
+
+  if ((p = gc_shared_alloc (GC_CHUNK)) == NULL) return NULL;
+
+  gc_fill (t->top, t->limit);
+  
+  t->top   = p + words;
+  t->limit = p + GC_CHUNK;
+  
+  return p;
+}
+
+static void gc_thread_forwarded (gc_thread *t, data *d) {
+  if (t->forwarded_size == t->forwarded_capacity) {
+    t->forwarded_capacity = t->forwarded_capacity ? t->forwarded_capacity << 1 : 1024;
+    t->forwarded          = (data**) realloc (t->forwarded, t->forwarded_capacity * sizeof (data*));
+    if (t->forwarded == NULL) {
+      perror ("ERROR: gc_thread_forwarded: realloc failed\n");
+      exit   (1);
+    }
+  }
+
+  t->forwarded [t->forwarded_size++] = d;
+}
+
+static void gc_thread_push (gc_thread *t, size_t *obj) {
+  pthread_mutex_lock (&t->lock);
+  
+  if (t->size == t->capacity) {
+    t->capacity = t->capacity ? t->capacity << 1 : 1024;
+    t->gray     = (size_t**) realloc (t->gray, t->capacity * sizeof (size_t*));
+    if (t->gray == NULL) {
+      perror ("ERROR: gc_thread_push: realloc failed\n");
+      exit   (1);
+    }
+  }
+
+  t->gray [t->size++] = obj;
+  
+  pthread_mutex_unlock (&t->lock);
+}
+
+static size_t * gc_thread_pop (gc_thread *t) {
+  size_t *obj = NULL;
+  
+  pthread_mutex_lock (&t->lock);
+  if (t->size) obj = t->gray [--t->size];
+  pthread_mutex_unlock (&t->lock);
+
+  return obj;
+}
+
+/* Moves a half of the victim's gray objects to the thief */
+static int gc_thread_steal (gc_thread *thief, gc_thread *victim) {
+  size_t *stolen [GC_CHUNK / 8];
+  int     n, i;
+
+  pthread_mutex_lock (&victim->lock);
+  n = (victim->size + 1) / 2;
+  if (n > GC_CHUNK / 8) n = GC_CHUNK / 8;
+  victim->size -= n;
+  memcpy (stolen, victim->gray + victim->size, n * sizeof (size_t*));
+  pthread_mutex_unlock (&victim->lock);
+
+  for (i = 0; i < n; i++) gc_thread_push (thief, stolen [i]);
+  
+  return n;
+}
+
+static size_t * gc_parallel_copy (gc_thread *t, size_t *obj) {
+  data   *d = TO_DATA(obj);
+  int     h = d->tag;
+  size_t *from, *copy, *res;
+  size_t  words;
+
+  if (IS_FORWARD_PTR(h)) return (size_t*) h;
+
+  switch (TAG(h)) {
+  case CLOSURE_TAG:
+  case ARRAY_TAG:
+    from  = (size_t*) d;
+    words = LEN(h) + 1;
+    break;
+
+  case STRING_TAG:
+    from  = (size_t*) d;
+    words = (LEN(h) + sizeof(int)) / sizeof(size_t) + 1;
+    break;
+
+  case SEXP_TAG:
+    from  = (size_t*) TO_SEXP(obj);
+    words = LEN(h) + 2;
+    break;
+
+  default:
+    perror ("ERROR: gc_parallel_copy: weird tag");
+    exit (1);
+  }
+
+  /* on overflow the object stays in place; the evacuation is undone anyway */
+  if ((copy = gc_thread_alloc (t, words)) == NULL) return obj;
+  
+  memcpy (copy, from, words * sizeof(size_t));
+  res  = copy + (obj - from);
+  res [-1] = h;
+  
+  if (__sync_bool_compare_and_swap (&d->tag, h, (int) res)) {
+    gc_thread_forwarded (t, d);
+    if (TAG(h) != STRING_TAG && LEN(h)) gc_thread_push (t, res);
+    return res;
+  }
+
+  /* another thread has copied the object first */
+  if (t->top == copy + words) t->top = copy;
+  else gc_fill (copy, copy + words);
+  
+  return (size_t*) d->tag;
+}
+
+/* A worker is counted in gc_active while it has (or is stealing) gray
+   objects; it finishes only when it is idle itself and gc_active drops to
+   zero, i.e. no thread can produce more work */
+static void* gc_worker (void *arg) {
+  gc_thread *t = (gc_thread*) arg;
+  size_t    *obj;
+  int        i, j, len, stolen;
+  
+  /* the same slot may be collected twice; it can be already updated by another thread */
+  for (i = t->id; i < gc_roots_size && ! gc_overflow; i += GC_THREADS)
+    if (IS_VALID_HEAP_POINTER(*gc_roots[i])) *gc_roots[i] = gc_parallel_copy (t, *gc_roots[i]);
+
+  while (1) {
+    while (! gc_overflow && (obj = gc_thread_pop (t)) != NULL) {
+      len = LEN(TO_DATA(obj)->tag);
+      for (j = 0; j < len; j++)
+	if (IS_VALID_HEAP_POINTER(obj[j])) obj[j] = (size_t) gc_parallel_copy (t, (size_t*) obj[j]);
+    }
+
+    __sync_fetch_and_sub (&gc_active, 1);
+
+    /* the stolen objects may be stolen again before the thief gets to
+       them, thus the thief always returns to its own stack */
+    for (i = 0, stolen = 0; ! stolen && gc_active && ! gc_overflow; i = (i + 1) % GC_THREADS) {
+      if (i == t->id || gc_threads[i].size == 0) {
+	if (i == t->id) sched_yield ();
+	continue;
+      }
+      
+      __sync_fetch_and_add (&gc_active, 1);
+      if (gc_thread_steal (t, &gc_threads[i])) stolen = 1;
+      else __sync_fetch_and_sub (&gc_active, 1);
+    }
+
+    if (! stolen) break;
+  }
+
+  gc_fill (t->top, t->limit);
+  
+  return NULL;
+}
+
+/* Restores the headers of the forwarded objects and the roots after an
+   overflow; the copies are abandoned, their fields were the only ones
+   updated */
+static void gc_parallel_undo (size_t **saved) {
+  int i, j;
+
+  for (i = 0; i < GC_THREADS; i++)
+    for (j = 0; j < gc_threads[i].forwarded_size; j++) {
+      data *d = gc_threads[i].forwarded[j];
+
+      d->tag = ((size_t*) d->tag)[-1];
+    }
+
+  for (i = 0; i < gc_roots_size; i++) *gc_roots[i] = saved[i];
+}
+
+/* The parallel collector wastes a part of to_space at the ends of the chunks;
+   it is tried only if to_space is likely to have room for that */
+static int gc_parallel_fits (void) {
+  size_t used = (from_space.current - from_space.begin) + (nursery.current - nursery.begin);
+  
+  return used + used / 7 + GC_THREADS * GC_CHUNK < to_space.size;
+}
+
+/* Returns 0 if to_space has run out and nothing has been evacuated */
+static int gc_parallel (void) {
+  pthread_t threads [MAX_GC_THREADS];
+  size_t  **saved;
+  int       i;
+  
+  gc_roots_size = 0;
+  collect_roots = 1;
+  
+  gc_root_scan_data ();
+  gc_root_scan_stack ();
+  
+  for (i = 0; i < extra_roots.current_free; i++)
+    gc_test_and_copy_root ((size_t**)extra_roots.roots[i]);
+
+  collect_roots = 0;
+  gc_active     = GC_THREADS;
+  gc_overflow   = 0;
+
+  saved = (size_t**) malloc ((gc_roots_size + 1) * sizeof (size_t*));
+  if (saved == NULL) {
+    perror ("ERROR: gc_parallel: malloc failed\n");
+    exit   (1);
+  }
+
+  for (i = 0; i < gc_roots_size; i++) saved[i] = *gc_roots[i];
+  
+  for (i = 0; i < GC_THREADS; i++) {
+    gc_threads[i].id             = i;
+    gc_threads[i].top            = NULL;
+    gc_threads[i].limit          = NULL;
+    gc_threads[i].size           = 0;
+    gc_threads[i].forwarded_size = 0;
+    pthread_mutex_init (&gc_threads[i].lock, NULL);
+  }
+
+  for (i = 1; i < GC_THREADS; i++) {
+    if (pthread_create (&threads[i], NULL, gc_worker, &gc_threads[i])) {
+      perror ("ERROR: gc_parallel: pthread_create failed\n");
+      exit   (1);
+    }
+  }
+
+  gc_worker (&gc_threads[0]);
+  
+  for (i = 1; i < GC_THREADS; i++) pthread_join (threads[i], NULL);
+
+  for (i = 0; i < GC_THREADS; i++) pthread_mutex_destroy (&gc_threads[i].lock);
+
+  if (gc_overflow) gc_parallel_undo (saved);
+
+  free (saved);
+
+  return ! gc_overflow;
+}
+
+static void gc_sequential (void) {
+  init_sexp_starts ();
 #ifdef DEBUG_PRINT
   print_indent ();
   printf ("gc: current:%p; to_space.b =%p; to_space.e =%p; \
@@ -1883,7 +4220,7 @@ static void* gc (size_t size) {
   print_indent ();
   printf ("gc: data is scanned\n"); fflush (stdout);
 #endif
-  __gc_root_scan_stack ();
+  gc_root_scan_stack ();
   for (int i = 0; i < extra_roots.current_free; i++) {
 #ifdef DEBUG_PRINT
     print_indent ();
@@ -1897,6 +4234,23 @@ static void* gc (size_t size) {
   print_indent ();
   printf ("gc: no more extra roots\n"); fflush (stdout);
 #endif
+  gc_scan_to_space  ();
+  clear_sexp_starts ();
+}
+
+static void* gc (size_t size) {
+  size_t live, need, new_size;
+  
+  if (! enable_GC) {
+    Lfailure ("GC disabled");
+  }
+  
+  current = to_space.begin;
+
+  if (! (GC_THREADS > 1 && gc_parallel_fits () && gc_parallel ())) {
+    current = to_space.begin;
+    gc_sequential ();
+  }
 
   if (!IN_PASSIVE_SPACE(current)) {
     printf ("gc: ASSERT: !IN_PASSIVE_SPACE(current) to_begin = %p to_end = %p \
@@ -1906,15 +4260,25 @@ static void* gc (size_t size) {
     exit   (1);
   }
 
-  while (current + size >= to_space.end) {
+  live = current - to_space.begin;
+  need = live + size + 2 * NURSERY_SIZE + 1;
+
+  gc_stats.major++;
+  gc_stats.survived  = live;
+  gc_stats.copied   += live;
+  
+  if (need > to_space.size) {
 #ifdef DEBUG_PRINT
     print_indent ();
     printf ("gc: pre-extend_spaces : %p %zu %p \n", current, size, to_space.end);
     fflush (stdout);
 #endif
-    if (extend_spaces ()) {
+    new_size = grown_space_size (need, 1);
+    gc_stats.growths++;
+    if (extend_spaces (new_size)) {
       gc_swap_spaces ();
-      init_to_space (1);
+      SPACE_SIZE = new_size;
+      init_to_space ();
       return gc (size);
     }
 #ifdef DEBUG_PRINT
@@ -1923,11 +4287,20 @@ static void* gc (size_t size) {
     fflush (stdout);
 #endif
   }
+  else if (HEAP_LIVE_RATIO && live > to_space.size / 100 * HEAP_LIVE_RATIO) {
+    /* the new size takes effect when the next to_space is prepared */
+    new_size = grown_space_size (live / HEAP_LIVE_RATIO * 100 + 1, 0);
+    if (new_size > SPACE_SIZE) gc_stats.growths++;
+    SPACE_SIZE = new_size;
+  }
   assert (IN_PASSIVE_SPACE(current));
   assert (current + size < to_space.end);
 
   gc_swap_spaces ();
   from_space.current = current + size;
+  gc_stats.allocated += nursery.current - nursery.begin;
+  nursery.current    = nursery.begin;
+  remembered.size    = 0;
 #ifdef DEBUG_PRINT
   print_indent ();
   printf ("gc: end: (allocate!) return %p; from_space.current %p; \
@@ -2031,29 +4404,62 @@ static void printFromSpace (void) {
 // alloc: allocates `size` bytes in heap
 extern void * alloc (size_t size) {
   void * p = (void*)BOX(NULL);
+  long long t;
   size = (size - 1) / sizeof(size_t) + 1; // convert bytes to words
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
   printf ("alloc: current: %p %zu words!", from_space.current, size);
   fflush (stdout);
 #endif
-  if (from_space.current + size < from_space.end) {
-    p = (void*) from_space.current;
-    from_space.current += size;
+  if (enable_GC && nursery.current + size < nursery.end) {
+    p = (void*) nursery.current;
+    nursery.current += size;
 #ifdef DEBUG_PRINT
     print_indent ();
-    printf (";new current: %p \n", from_space.current); fflush (stdout);
+    printf (";new current: %p \n", nursery.current); fflush (stdout);
     indent--;
 #endif
     return p;
   }
+
+  /* A minor collection requires the room for all promoted objects; afterwards the
+     nursery is empty, hence an object which does not fit into it can be allocated
+     directly in the old generation without breaking the remembered set invariant;
+     with GC disabled the nursery is always empty */
+  if (!enable_GC || from_space.current + 2 * NURSERY_SIZE < from_space.end) {
+    if (enable_GC) {
+      minor_gc ();
+    
+      if (nursery.current + size < nursery.end) {
+	p = (void*) nursery.current;
+	nursery.current += size;
+#ifdef DEBUG_PRINT
+	indent--;
+#endif
+	return p;
+      }
+    }
+
+    if (from_space.current + size + NURSERY_SIZE < from_space.end) {
+      p = (void*) from_space.current;
+      from_space.current += size;
+      gc_stats.allocated += size;
+#ifdef DEBUG_PRINT
+      indent--;
+#endif
+      return p;
+    }
+  }
   
-  init_to_space (0);
+  init_to_space ();
+  t = gc_clock ();
+  gc_stats.allocated += size;
 #ifdef DEBUG_PRINT
   print_indent ();
   printf ("alloc: call gc: %zu\n", size); fflush (stdout);
   printFromSpace(); fflush (stdout);
   p = gc (size);
+  gc_pause (t);
   print_indent ();
   printf("alloc: gc END %p %p %p %p\n\n", from_space.begin,
 	 from_space.end, from_space.current, p); fflush (stdout);
@@ -2061,7 +4467,9 @@ extern void * alloc (size_t size) {
   indent--;
   return p;
 #else
-  return gc (size);
+  p = gc (size);
+  gc_pause (t);
+  return p;
 #endif
 }
 # endif
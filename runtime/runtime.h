@@ -12,9 +12,41 @@
 # include <regex.h>
 # include <time.h>
 # include <limits.h>
+# include <stdint.h>
+# include <pthread.h>
+# include <sched.h>
+# include <unistd.h>
+# include <fcntl.h>
+# include <sys/stat.h>
 
 # define WORD_SIZE (CHAR_BIT * sizeof(int))
 
+# define STRING_TAG  0x00000001
+# define ARRAY_TAG   0x00000003
+# define SEXP_TAG    0x00000005
+# define CLOSURE_TAG 0x00000007 
+# define UNBOXED_TAG 0x00000009 // Not actually a tag; used to return from LkindOf
+
+# define LEN(x) ((x & 0xFFFFFFF8) >> 3)
+# define TAG(x)  (x & 0x00000007)
+
+# define TO_DATA(x) ((data*)((char*)(x)-sizeof(int)))
+# define TO_SEXP(x) ((sexp*)((char*)(x)-2*sizeof(int)))
+
+# define UNBOXED(x)  (((int) (x)) &  0x0001)
+# define UNBOX(x)    (((int) (x)) >> 1)
+# define BOX(x)      ((((int) (x)) << 1) | 0x0001)
+
+typedef struct {
+  int tag; 
+  char contents[0];
+} data; 
+
+typedef struct {
+  int tag; 
+  data contents; 
+} sexp;
+
 void failure (char *s, ...);
 
 # endif
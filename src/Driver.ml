@@ -21,6 +21,8 @@ class options args =
     "  -ds       --- dump stack machine code (the output will be written into .sm file; has no\n" ^
     "                effect if -i option is specfied)\n" ^
     "  -b        --- compile to a stack machine bytecode\n" ^    
+    "  -O        --- optimize stack machine code (with -ds, the numbers of instructions before\n" ^
+    "                and after the optimization will be written into .sm.counts file)\n" ^
     "  -v        --- show version\n" ^
     "  -h        --- show this help\n"
   in
@@ -34,6 +36,7 @@ class options args =
     val mode    = ref (`Default : [`Default | `Eval | `SM | `Compile | `BC])
     val curdir  = Unix.getcwd ()
     val debug   = ref false
+    val opt     = ref false
     (* Workaround until Ostap starts to memoize properly *)
     val const  = ref false
     (* end of the workaround *)
@@ -58,6 +61,7 @@ class options args =
             | "-h"  -> self#set_help
             | "-v"  -> self#set_version
             | "-g"  -> self#set_debug
+            | "-O"  -> self#set_optimize
             | _ ->
                if opt.[0] = '-'
                then raise (Commandline_error (Printf.sprintf "Invalid command line specifier ('%s')" opt))
@@ -137,6 +141,23 @@ class options args =
       if (!dump land dump_sm) > 0
       then self#dump_file "sm" (SM.show_prg sm)
       else ()
+    method dump_SM_counts before after =
+      if (!dump land dump_sm) > 0
+      then (
+        let module M = Map.Make (String) in
+        let count which m insn =
+          let s    = SM.show_insn insn in
+          let k    = try String.sub s 0 (String.index s ' ') with Not_found -> s in
+          let b, a = try M.find k m with Not_found -> 0, 0 in
+          M.add k (if which then (b+1, a) else (b, a+1)) m
+        in
+        let m   = List.fold_left (count true) M.empty before in
+        let m   = List.fold_left (count false) m after in
+        let buf = Buffer.create 1024 in
+        M.iter (fun k (b, a) -> Buffer.add_string buf (Printf.sprintf "%-8s %8d %8d\n" k b a)) m;
+        Buffer.add_string buf (Printf.sprintf "%-8s %8d %8d\n" "total" (List.length before) (List.length after));
+        self#dump_file "sm.counts" (Buffer.contents buf)
+      )
     method greet =
       (match !outfile with
        | None   -> ()
@@ -148,6 +169,9 @@ class options args =
       if !debug then "" else "-g"
     method set_debug =
       debug := true
+    method is_optimizing = !opt
+    method private set_optimize =
+      opt := true
   end
 
 let main =
@@ -93,6 +93,7 @@ module ByteCode =
         Found i -> i
 
 (* Below are the the numbers of occurrencies of SM instructions for the stdlib+lama compiler itself
+   ("byterun/smfreq *.sm" recomputes them, "byterun/smfreq -n 2 *.sm" counts pairs, etc.)
 
    7328 SLABEL
    5351 CALL
@@ -122,6 +123,36 @@ module ByteCode =
      16 FLABEL
  *)
 
+    (* Appends an integer in the signed LEB128 encoding *)
+    let rec add_sleb128 buf x =
+      let b = x land 0x7f and x' = x asr 7 in
+      if (x' = 0 && b land 0x40 = 0) || (x' = -1 && b land 0x40 <> 0)
+      then Buffer.add_char buf (Char.chr b)
+      else (Buffer.add_char buf (Char.chr (b lor 0x80)); add_sleb128 buf x')
+
+    (* Bytecode file (version 2), all the integers are 32-bit little-endian:
+
+         "LAMA" version:32 n:32          --- header
+         (kind:32 offset:32 size:32)*n   --- section directory
+         sections, each at a page-aligned offset:
+           1 code    --- instructions; operands are LEB128-encoded, except for
+                         code offsets (labels), which are 32-bit
+           2 strings --- zero-terminated strings, referred to by offsets
+           3 publics --- (name:32 offset:32)*
+           4 imports --- name:32*
+           5 lines   --- (offset:32 line:32)*, ordered by offsets
+           6 globals --- n:32 name:32*n, the names of global variables by their indices
+           7 externs --- name:32*, the symbols defined in other units
+           8 relocs  --- (offset:32 name:32)*, the code offsets to patch with the
+                         addresses of external symbols (see "byterun -l")
+
+       A public symbol is either a function label, bound to a code offset, or the
+       name of a global variable "global_<name>", bound to its index. Page alignment
+       allows a file to be mapped into memory and used in place *)
+    let magic       = "LAMA"
+    let version     = 2
+    let page_size   = 4096
+
     let compile cmd insns =
       let word_size          = 4                                                                                   in
       let code               = Buffer.create 256                                                                   in
@@ -129,16 +160,29 @@ module ByteCode =
       let lmap               = Stdlib.ref M.empty                                                                  in
       let pubs               = Stdlib.ref S.empty                                                                  in
       let imports            = Stdlib.ref S.empty                                                                  in
+      let externs            = Stdlib.ref S.empty                                                                  in
       let globals            = Stdlib.ref M.empty                                                                  in
       let glob_count         = Stdlib.ref 0                                                                        in
       let fixups             = Stdlib.ref []                                                                       in
+      let lines              = Stdlib.ref []                                                                       in
       let add_lab   l        = lmap := M.add l (Buffer.length code) !lmap                                          in
       let add_public l       = pubs := S.add l !pubs                                                               in
       let add_import l       = imports := S.add l !imports                                                         in      
+      let add_extern l       = externs := S.add l !externs                                                         in
       let add_fixup l        = fixups := (Buffer.length code, l) :: !fixups                                        in      
       let add_bytes          = List.iter (fun x -> Buffer.add_char     code @@ Char .chr                        x) in
-      let add_ints           = List.iter (fun x -> Buffer.add_int32_ne code @@ Int32.of_int                     x) in
-      let add_strings        = List.iter (fun x -> Buffer.add_int32_ne code @@ Int32.of_int @@ StringTab.add st x) in
+      let add_ints           = List.iter (add_sleb128 code)                                                        in
+      let add_strings        = List.iter (fun x -> add_sleb128 code @@ StringTab.add st x)                          in
+      let add_label l        = add_fixup l; Buffer.add_int32_le code 0l                                            in
+      let add_line n         = lines := (Buffer.length code, n) :: !lines                                          in
+      let global_index s     =
+        try M.find s !globals
+        with Not_found ->
+          let i = !glob_count in
+          incr glob_count;
+          globals := M.add s i !globals;
+          i
+      in
       let add_designations n =
         let b x =
           match n with
@@ -146,16 +190,7 @@ module ByteCode =
           | Some b -> b * 16 + x
         in
         List.iter (function
-                   | Value.Global s ->
-                      let i =
-                        try M.find s !globals
-                        with Not_found ->
-                          let i = !glob_count in
-                          incr glob_count;
-                          globals := M.add s i !globals;
-                          i
-                      in
-                      add_bytes [b 0]; add_ints [i]
+                   | Value.Global s -> add_bytes [b 0]; add_ints [global_index s]
                    | Value.Local  n -> add_bytes [b 1]; add_ints    [n]
                    | Value.Arg    n -> add_bytes [b 2]; add_ints    [n]
                    | Value.Access n -> add_bytes [b 3]; add_ints    [n]
@@ -163,9 +198,9 @@ module ByteCode =
       in
       let insn_code = function
       (* 0x0s                 *) | BINOP   s                   -> add_bytes [opnum s]
-      (* 0x10 n:32            *) | CONST   n                   -> add_bytes [1*16 + 0]; add_ints [n]
-      (* 0x11 s:32            *) | STRING  s                   -> add_bytes [1*16 + 1]; add_strings [s]
-      (* 0x12 s:32 n:32       *) | SEXP   (s, n)               -> add_bytes [1*16 + 2]; add_strings [s]; add_ints [n]
+      (* 0x10 n:v             *) | CONST   n                   -> add_bytes [1*16 + 0]; add_ints [n]
+      (* 0x11 s:v             *) | STRING  s                   -> add_bytes [1*16 + 1]; add_strings [s]
+      (* 0x12 s:v n:v         *) | SEXP   (s, n)               -> add_bytes [1*16 + 2]; add_strings [s]; add_ints [n]
       (* 0x13                 *) | STI                         -> add_bytes [1*16 + 3]
       (* 0x14                 *) | STA                         -> add_bytes [1*16 + 4]
                                                                
@@ -173,7 +208,7 @@ module ByteCode =
                                  | FLABEL  s                 
                                  | SLABEL  s                   -> add_lab s
                                                                
-      (* 0x15 l:32            *) | JMP     s                   -> add_bytes [1*16 + 5]; add_fixup s; add_ints [0]
+      (* 0x15 l:32            *) | JMP     s                   -> add_bytes [1*16 + 5]; add_label s
       (* 0x16                 *) | END                         -> add_bytes [1*16 + 6]
       (* 0x17                 *) | RET                         -> add_bytes [1*16 + 7]
       (* 0x18                 *) | DROP                        -> add_bytes [1*16 + 8]
@@ -181,56 +216,114 @@ module ByteCode =
       (* 0x1a                 *) | SWAP                        -> add_bytes [1*16 + 10]
       (* 0x1b                 *) | ELEM                        -> add_bytes [1*16 + 11]
                                                                    
-      (* 0x2d n:32            *) | LD      d                   -> add_designations (Some 2) [d]
-      (* 0x3d n:32            *) | LDA     d                   -> add_designations (Some 3) [d]
-      (* 0x4d n:32            *) | ST      d                   -> add_designations (Some 4) [d]
+      (* 0x2d n:v             *) | LD      d                   -> add_designations (Some 2) [d]
+      (* 0x3d n:v             *) | LDA     d                   -> add_designations (Some 3) [d]
+      (* 0x4d n:v             *) | ST      d                   -> add_designations (Some 4) [d]
                                                                  
-      (* 0x50 l:32            *) | CJMP    ("z" , s)           -> add_bytes [5*16 + 0]; add_fixup s; add_ints [0]
-      (* 0x51 l:32            *) | CJMP    ("nz", s)           -> add_bytes [5*16 + 1]; add_fixup s; add_ints [0]
+      (* 0x50 l:32            *) | CJMP    ("z" , s)           -> add_bytes [5*16 + 0]; add_label s
+      (* 0x51 l:32            *) | CJMP    ("nz", s)           -> add_bytes [5*16 + 1]; add_label s
 
       (* 0x70                 *) | CALL ("Lread", _, _)        -> add_bytes [7*16 + 0]                                                                                          
       (* 0x71                 *) | CALL ("Lwrite", _, _)       -> add_bytes [7*16 + 1]
       (* 0x72                 *) | CALL ("Llength", _, _)      -> add_bytes [7*16 + 2]
       (* 0x73                 *) | CALL ("Lstring", _, _)      -> add_bytes [7*16 + 3]
-      (* 0x74                 *) | CALL (".array", n, _)       -> add_bytes [7*16 + 4]; add_ints [n]
+      (* 0x74 n:v             *) | CALL (".array", n, _)       -> add_bytes [7*16 + 4]; add_ints [n]
                                                                   
-      (* 0x52 n:32 n:32       *) | BEGIN   (_, a, l, [], _, _) -> add_bytes [5*16 + 2]; add_ints [a; l] (* with no closure *)
-      (* 0x53 n:32 n:32       *) | BEGIN   (_, a, l,  _, _, _) -> add_bytes [5*16 + 3]; add_ints [a; l] (* with a closure  *)
-      (* 0x54 l:32 n:32 d*:32 *) | CLOSURE (s, ds)             -> add_bytes [5*16 + 4]; add_fixup s; add_ints [0; List.length ds]; add_designations None ds
-      (* 0x55 n:32            *) | CALLC   (n, tail)           -> add_bytes [5*16 + 5]; add_ints [n]
-      (* 0x56 l:32 n:32       *) | CALL    (fn, n, tail)       -> add_bytes [5*16 + 6]; add_fixup fn; add_ints [0; n]
-      (* 0x57 s:32 n:32       *) | TAG     (s, n)              -> add_bytes [5*16 + 7]; add_strings [s]; add_ints [n]
-      (* 0x58 n:32            *) | ARRAY    n                  -> add_bytes [5*16 + 8]; add_ints [n]
-      (* 0x59 n:32 n:32       *) | FAIL    ((l, c), _)         -> add_bytes [5*16 + 9]; add_ints [l; c]
-      (* 0x5a n:32            *) | LINE     n                  -> add_bytes [5*16 + 10]; add_ints [n]
+      (* 0x52 n:v n:v         *) | BEGIN   (_, a, l, [], _, _) -> add_bytes [5*16 + 2]; add_ints [a; l] (* with no closure *)
+      (* 0x53 n:v n:v         *) | BEGIN   (_, a, l,  _, _, _) -> add_bytes [5*16 + 3]; add_ints [a; l] (* with a closure  *)
+      (* 0x54 l:32 n:v d*     *) | CLOSURE (s, ds)             -> add_bytes [5*16 + 4]; add_label s; add_ints [List.length ds]; add_designations None ds
+      (* 0x55 n:v             *) | CALLC   (n, tail)           -> add_bytes [5*16 + 5]; add_ints [n]
+      (* 0x56 l:32 n:v        *) | CALL    (fn, n, tail)       -> add_bytes [5*16 + 6]; add_label fn; add_ints [n]
+      (* 0x57 s:v n:v         *) | TAG     (s, n)              -> add_bytes [5*16 + 7]; add_strings [s]; add_ints [n]
+      (* 0x58 n:v             *) | ARRAY    n                  -> add_bytes [5*16 + 8]; add_ints [n]
+      (* 0x59 n:v n:v         *) | FAIL    ((l, c), _)         -> add_bytes [5*16 + 9]; add_ints [l; c]
+      (* line table           *) | LINE     n                  -> add_line n
       (* 0x6p                 *) | PATT     p                  -> add_bytes [6*16 + enum(patt) p]
 
-                                 | EXTERN  s                   -> ()
+                                 | EXTERN  s                   -> add_extern s
                                  | PUBLIC  s                   -> add_public s
                                  | IMPORT  s                   -> add_import s
       in
-      List.iter insn_code insns;
+      let cond_code   = function "z" -> 0 | _ -> 1                                                                in
+      let is_builtin  = function "Lread" | "Lwrite" | "Llength" | "Lstring" | ".array" -> true | _ -> false       in
+      (* Superinstructions: the most frequent sequences (see the table above, which
+         byterun/smfreq recomputes for any set of sources) are fused into single
+         instructions; since labels are instructions on their own, a fused
+         sequence never contains a jump target *)
+      let rec insns_code = function
+      (* 0x80/1 s:v n:v l:32  *) | DUP :: TAG (s, n) :: CJMP (c, l) :: insns      -> add_bytes [8*16 + 0 + cond_code c]; add_strings [s]; add_ints [n]; add_label l; insns_code insns
+      (* 0x82/3 n:v l:32      *) | DUP :: ARRAY n :: CJMP (c, l) :: insns         -> add_bytes [8*16 + 2 + cond_code c]; add_ints [n]; add_label l; insns_code insns
+      (* 0x84 n:v             *) | DUP :: CONST n :: ELEM :: insns                -> add_bytes [8*16 + 4]; add_ints [n]; insns_code insns
+      (* 0x85 o:8 d d         *) | LD d1 :: LD d2 :: BINOP s :: insns             -> add_bytes [8*16 + 5; opnum s]; add_designations None [d1; d2]; insns_code insns
+      (* 0x86 o:8 n:v         *) | CONST n :: BINOP s :: insns                    -> add_bytes [8*16 + 6; opnum s]; add_ints [n]; insns_code insns
+      (* 0x87 l:32 n:v        *) | CALL (fn, n, _) :: DROP :: insns
+                                   when not (is_builtin fn)                       -> add_bytes [8*16 + 7]; add_label fn; add_ints [n]; insns_code insns
+      (* 0x88/9 o:8 l:32      *) | BINOP s :: CJMP (c, l) :: insns                -> add_bytes [8*16 + 8 + cond_code c; opnum s]; add_label l; insns_code insns
+      (* 0x9d n:v             *) | ST d :: DROP :: insns                          -> add_designations (Some 9) [d]; insns_code insns
+                                 | insn :: insns                                  -> insn_code insn; insns_code insns
+                                 | []                                             -> ()
+      in
+      insns_code insns;
       add_bytes [255];
       let code = Buffer.to_bytes code in
-      List.iter
-        (fun (ofs, l) ->
-          Bytes.set_int32_ne code ofs (Int32.of_int @@ try M.find l !lmap with Not_found -> failwith (Printf.sprintf "ERROR: undefined label '%s'" l))
-        )
-        !fixups;
-      let pubs = List.map
+      let undefined l = failwith (Printf.sprintf "ERROR: undefined label '%s'" l) in
+      (* references to the labels of other units are left to the linker *)
+      let relocs =
+        List.fold_left
+          (fun relocs (ofs, l) ->
+            match M.find_opt l !lmap with
+            | Some o -> Bytes.set_int32_le code ofs (Int32.of_int o); relocs
+            | None   -> if S.mem l !externs then ofs :: StringTab.add st l :: relocs else undefined l
+          )
+          []
+          !fixups
+      in
+      let ints xs =
+        let b = Buffer.create 64 in
+        List.iter (fun x -> Buffer.add_int32_le b @@ Int32.of_int x) xs;
+        Buffer.to_bytes b
+      in
+      let externs = List.map (StringTab.add st) @@ S.elements (S.diff !externs !pubs) in
+      (* a public variable refers to its global index, a public function --- to its code offset *)
+      let global_prefix = "global_" in
+      let is_global l   = String.length l > String.length global_prefix && String.sub l 0 (String.length global_prefix) = global_prefix in
+      let pubs = List.concat @@ List.map
         (fun l ->
-          Int32.of_int @@ StringTab.add st l,
-          (Int32.of_int @@ try M.find l !lmap with Not_found -> failwith (Printf.sprintf "ERROR: undefined label '%s'" l))
+          [StringTab.add st l;
+           if is_global l
+           then global_index (String.sub l (String.length global_prefix) (String.length l - String.length global_prefix))
+           else try M.find l !lmap with Not_found -> undefined l]
         ) @@ S.elements !pubs
       in
-      let st   = Buffer.to_bytes st.StringTab.buffer in
-      let file = Buffer.create 1024 in
-      Buffer.add_int32_ne file (Int32.of_int @@ Bytes.length st);
-      Buffer.add_int32_ne file (Int32.of_int @@ !glob_count);
-      Buffer.add_int32_ne file (Int32.of_int @@ List.length pubs);
-      List.iter (fun (n, o) -> Buffer.add_int32_ne file n; Buffer.add_int32_ne file o) pubs;
-      Buffer.add_bytes file st;
-      Buffer.add_bytes file code;
+      let imports = List.map (StringTab.add st) @@ S.elements !imports in
+      let globals =
+        let names = Array.make !glob_count 0 in
+        M.iter (fun s i -> names.(i) <- StringTab.add st s) !globals;
+        !glob_count :: Array.to_list names
+      in
+      let lines    = List.concat @@ List.rev_map (fun (o, n) -> [o; n]) !lines in
+      let sections = [1, code;
+                      2, Buffer.to_bytes st.StringTab.buffer;
+                      3, ints pubs;
+                      4, ints imports;
+                      5, ints lines;
+                      6, ints globals;
+                      7, ints externs;
+                      8, ints relocs]
+      in
+      let align n    = (n + page_size - 1) / page_size * page_size in
+      let file       = Buffer.create 4096 in
+      let pad n      = Buffer.add_string file (String.make (n - Buffer.length file) '\000') in
+      let dir, _     =
+        List.fold_left
+          (fun (dir, ofs) (kind, b) -> (kind, ofs, Bytes.length b) :: dir, align (ofs + Bytes.length b))
+          ([], align (12 + 12 * List.length sections))
+          sections
+      in
+      Buffer.add_string file magic;
+      Buffer.add_bytes  file (ints [version; List.length sections]);
+      List.iter (fun (kind, ofs, size) -> Buffer.add_bytes file (ints [kind; ofs; size])) @@ List.rev dir;
+      List.iter2 (fun (_, ofs, _) (_, b) -> pad ofs; Buffer.add_bytes file b) (List.rev dir) sections;
       let f = open_out_bin (Printf.sprintf "%s.bc" cmd#basename) in
       Buffer.output_buffer f file;
       close_out f
@@ -453,6 +546,119 @@ let run p i =
   in
   o 
 
+(* Stack machine optimizer
+
+     val optimize : prg -> prg
+
+   Rewrites the code produced by the compiler before it reaches the backends: folds
+   binary operations and conditional jumps on constants, cancels values which are
+   computed only to be dropped, forwards a stored value to the load of the same
+   variable which follows, threads jumps to jumps, removes unreachable code and the
+   labels nobody refers to. Scope labels, forwarded labels, BEGIN and END are kept
+   since the native code generator relies on them. The steps are repeated while they
+   change anything.
+*)
+module Optimizer =
+  struct
+
+    module S = Set.Make (String)
+
+    (* boxed integers have 31 bits *)
+    let fits n = n >= - (1 lsl 30) && n < 1 lsl 30
+
+    let fold op x y =
+      match op, y with
+      | ("/" | "%"), 0 -> None
+      | _              -> let r = Expr.to_func op x y in if fits r then Some r else None
+
+    let rec is_next l = function
+    | (LABEL l' | FLABEL l' | SLABEL l') :: prg -> l = l' || is_next l prg
+    | _                                         -> false
+
+    let rec peephole = function
+    | CONST x :: CONST y :: BINOP op :: prg ->
+       (match fold op x y with
+        | Some r -> peephole (CONST r :: prg)
+        | None   -> CONST x :: peephole (CONST y :: BINOP op :: prg)
+       )
+    | CONST x :: CJMP (c, l) :: prg ->
+       if (c = "z") = (x = 0) then JMP l :: peephole prg else peephole prg
+    | (DUP | CONST _ | STRING _ | LD _ | LDA _) :: DROP :: prg -> peephole prg
+    | ST d :: DROP :: LD d' :: prg when d = d' -> peephole (ST d :: prg)
+    | ST d :: DROP :: LINE n :: LD d' :: prg when d = d' -> ST d :: LINE n :: peephole prg
+    | JMP l :: prg when is_next l prg -> peephole prg
+    | insn :: prg -> insn :: peephole prg
+    | [] -> []
+
+    (* a jump to a label which is followed by a jump goes directly to the target of the latter *)
+    let thread prg =
+      let rec target = function
+      | (LABEL _ | FLABEL _ | SLABEL _ | LINE _) :: prg -> target prg
+      | JMP l :: _                                      -> Some l
+      | _                                               -> None
+      in
+      let rec collect m = function
+      | LABEL l :: prg -> collect (match target prg with Some l' -> M.add l l' m | None -> m) prg
+      | _ :: prg       -> collect m prg
+      | []             -> m
+      in
+      let m = collect M.empty prg in
+      let rec resolve seen l =
+        match (try Some (M.find l m) with Not_found -> None) with
+        | Some l' when not (List.mem l' seen) -> resolve (l' :: seen) l'
+        | _                                   -> l
+      in
+      List.map (function JMP l -> JMP (resolve [l] l) | CJMP (c, l) -> CJMP (c, resolve [l] l) | insn -> insn) prg
+
+    (* the code which follows JMP up to a label is unreachable; after RET and FAIL a
+       jump is kept since the native code generator restores the stack layout at the
+       next label from it *)
+    let eliminate prg =
+      let rec dead keep = function
+      | (LABEL _ | FLABEL _ | SLABEL _ | BEGIN _ | END) :: _ as prg -> prg
+      | ((PUBLIC _ | EXTERN _ | IMPORT _) as insn) :: prg         -> insn :: dead keep prg
+      | (JMP _ as insn) :: prg when keep                          -> insn :: dead false prg
+      | _ :: prg                                                  -> dead keep prg
+      | []                                                        -> []
+      in
+      let rec inner = function
+      | (JMP _ as insn) :: prg          -> insn :: inner (dead false prg)
+      | ((RET | FAIL _) as insn) :: prg -> insn :: inner (dead true prg)
+      | insn :: prg                     -> insn :: inner prg
+      | []                              -> []
+      in
+      inner prg
+
+    let clean prg =
+      let refs =
+        List.fold_left
+          (fun refs -> function
+           | JMP l | CJMP (_, l) | CALL (l, _, _) | CLOSURE (l, _) | PROTO (l, _) | PPROTO (l, _)
+           | PUBLIC l | EXTERN l -> S.add l refs
+           | _                   -> refs
+          )
+          S.empty
+          prg
+      in
+      let rec inner = function
+      | LABEL l :: (BEGIN _ :: _ as prg)           -> LABEL l :: inner prg
+      | LABEL l :: prg when not (S.mem l refs)     -> inner prg
+      | insn :: prg                                -> insn :: inner prg
+      | []                                         -> []
+      in
+      inner prg
+
+    let optimize prg =
+      let rec iterate n prg =
+        let prg' = clean @@ eliminate @@ thread @@ peephole prg in
+        if n = 0 || prg' = prg then prg' else iterate (n-1) prg'
+      in
+      iterate 16 prg
+
+  end
+
+let optimize = Optimizer.optimize
+
 (* Stack machine compiler
 
      val compile : Language.t -> prg
@@ -1145,5 +1351,10 @@ let compile cmd ((imports, infixes), p) =
    *)
   (*Printf.eprintf "Before fix:\n%s\n" (show_prg prg);  *)
   let prg = fix_closures env prg in
+  let prg =
+    if cmd#is_optimizing
+    then (let prg' = optimize prg in cmd#dump_SM_counts prg prg'; prg')
+    else prg
+  in
   cmd#dump_SM prg;
   prg
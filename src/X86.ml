@@ -173,12 +173,13 @@ let compile cmd env imports code =
           let env, pushs   = push_args env [] n in
           let pushs        = List.rev pushs     in
           let closure, env = env#pop            in
+          let env, smap    = env#stack_map (List.length pushr + List.length pushs) in
           let call_closure =
             if on_stack closure
             then [Mov (closure, edx); Mov (edx, eax); CallI eax]
             else [Mov (closure, edx); CallI closure]
           in
-          env, pushr @ pushs @ call_closure @ [Binop ("+", L (word_size * List.length pushs), esp)] @ (List.rev popr) 
+          env, pushr @ pushs @ call_closure @ [smap; Binop ("+", L (word_size * List.length pushs), esp)] @ (List.rev popr) 
         in
         let y, env = env#allocate in env, code @ [Mov (eax, y)]
       )
@@ -220,11 +221,47 @@ let compile cmd env imports code =
             | "Bsta"   -> pushs
             | _        -> List.rev pushs
           in
-          env, pushr @ pushs @ [Call f; Binop ("+", L (word_size * List.length pushs), esp)] @ (List.rev popr) 
+          let env, smap = env#stack_map (List.length pushr + List.length pushs) in
+          env, pushr @ pushs @ [Call f; smap; Binop ("+", L (word_size * List.length pushs), esp)] @ (List.rev popr) 
         in
         let y, env = env#allocate in env, code @ [Mov (eax, y)]
       )
     in
+    (* inline allocation in the nursery (see runtime.c): bumps the nursery pointer, fills
+       the header and the fields of an object and leaves a pointer to its contents
+       in %eax; on overflow the runtime function is called (slow code, which
+       ends with moving %eax into the result position) *)
+    let inline_alloc env sexp_tag header fields slow =
+      let words      = List.length fields + 1 + (match sexp_tag with Some _ -> 1 | None -> 0) in
+      let off        = match sexp_tag with Some _ -> word_size | None -> 0 in
+      let lslow, env = env#new_label in
+      let ldone, env = env#new_label in
+      let slow, result =
+        match List.rev slow with
+        | result :: slow -> List.rev slow, result
+        | []             -> invalid_arg "inline_alloc"
+      in
+      let store i x =
+        let dst = I (off + word_size * (i + 1), eax) in
+        match x with
+        | R _ | L _ -> [Mov (x, dst)]
+        | _         -> [Mov (x, edi); Mov (edi, dst)]
+      in
+      env,
+      [Mov   (M "nursery+8", eax);
+       Lea   (I (word_size * words, eax), edi);
+       Binop ("cmp", M "nursery+4", edi);
+       CJmp  ("ae", lslow);
+       Mov   (edi, M "nursery+8")] @
+      (match sexp_tag with Some t -> [Mov (L t, I (0, eax))] | None -> []) @
+      [Mov (L header, I (off, eax))] @
+      List.concat (List.mapi store fields) @
+      [Lea (I (off + word_size, eax), eax);
+       Jmp ldone;
+       Label lslow] @
+      slow @
+      [Label ldone; result]
+    in
     match scode with
     | [] -> env, []
     | instr :: scode' ->
@@ -251,16 +288,19 @@ let compile cmd env imports code =
              let push_closure =
                List.map (fun d -> Push (env#loc d)) @@ List.rev closure
              in
+             let env, smap = env#stack_map (List.length pushr + closure_len + 2) in
              let s, env = env#allocate in             
-             (env,
-              pushr @
-              push_closure @
-              [Push (M ("$" ^ name));
-              Push (L (box closure_len));
-              Call "Bclosure";
-              Binop ("+", L (word_size * (closure_len + 2)), esp); 
-              Mov (eax, s)] @
-              List.rev popr @ env#reload_closure)
+             inline_alloc env None (7 lor ((closure_len + 1) lsl 3))
+               (M ("$" ^ name) :: List.map env#loc closure)
+               (pushr @
+                push_closure @
+                [Push (M ("$" ^ name));
+                 Push (L (box closure_len));
+                 Call "Bclosure";
+                 smap;
+                 Binop ("+", L (word_size * (closure_len + 2)), esp)] @
+                List.rev popr @ env#reload_closure @
+                [Mov (eax, s)])
              
   	  | CONST n ->
              let s, env' = env#allocate in
@@ -286,6 +326,19 @@ let compile cmd env imports code =
 	      | _         -> [Mov (env'#loc x, s)]
 	     )
 
+          | ST (Value.Access _ as x) ->
+             (* closure cells live in the heap, thus the store goes through the write barrier *)
+	     let env' = env#variable x in
+             let s    = env'#peek      in
+             let pushr, popr =
+               List.split @@ List.map (fun r -> (Push r, Pop r)) (env'#live_registers 0)
+             in
+             let pushr, popr = env'#save_closure @ pushr, env'#rest_closure @ popr in
+             env',
+             pushr @
+             [Push s; Lea (env'#loc x, eax); Push eax; Call "Bsti"; Binop ("+", L (2 * word_size), esp)] @
+             List.rev popr
+
           | ST x ->
 	     let env' = env#variable x in
              let s    = env'#peek      in
@@ -299,12 +352,7 @@ let compile cmd env imports code =
              call env ".sta" 3 false
 
 	  | STI ->
-             let v, x, env' = env#pop2 in
-             env'#push x,
-             (match x with
-              | S _ | M _ -> [Mov (v, edx); Mov (x, eax); Mov (edx, I (0, eax)); Mov (edx, x)] @ env#reload_closure
-              | _         -> [Mov (v, eax); Mov (eax, I (0, x)); Mov (eax, x)]
-             )
+             call env ".sti" 2 false
 
           | BINOP op ->
 	     let x, y, env' = env#pop2 in
@@ -426,6 +474,16 @@ let compile cmd env imports code =
              env#assert_empty_stack;
              let has_closure = closure <> [] in
              let env         = env#enter f nargs nlocals has_closure in
+             let env, args_map = if f = "main" then env#stack_map 2 else (env, Meta "") in
+             let env, init_maps =
+               if f = cmd#topname
+               then
+                 List.fold_left
+                   (fun (env, maps) _ -> let env, m = env#stack_map 0 in env, m :: maps)
+                   (env, [])
+                   (List.filter (fun i -> i <> "Std") imports)
+               else (env, [])
+             in
              env, [Meta (Printf.sprintf "\t.type %s, @function" name)] @
                   (if f = "main"
                    then []
@@ -460,11 +518,11 @@ let compile cmd env imports code =
 	           Repmovsl
                   ] @
                   (if f = "main"
-                   then [Call "__gc_init"; Push (I (12, ebp)); Push (I (8, ebp)); Call "set_args"; Binop ("+", L 8, esp)]
+                   then [Call "__gc_init"; Push (I (12, ebp)); Push (I (8, ebp)); Call "set_args"; args_map; Binop ("+", L 8, esp)]
                    else []
                   ) @
                   (if f = cmd#topname
-                   then List.map (fun i -> Call ("init" ^ i)) (List.filter (fun i -> i <> "Std") imports)
+                   then List.concat @@ List.map2 (fun i m -> [Call ("init" ^ i); m]) (List.filter (fun i -> i <> "Std") imports) (List.rev init_maps)
                    else []
                   )    
 
@@ -495,13 +553,20 @@ let compile cmd env imports code =
 
           | ELEM              -> call env ".elem" 2 false
                                
+          | CALL (".array", n, _) ->
+             let fields    = List.rev (env#peek_n n) in
+             let env, code = call env ".array" n false in
+             inline_alloc env None (3 lor (n lsl 3)) fields code
+             
           | CALL (f, n, tail) -> call env f n tail
                          
           | CALLC (n, tail) -> callc env n tail
               
           | SEXP (t, n) ->
-             let s, env = env#allocate in
+             let fields    = List.rev (env#peek_n n) in
+             let s, env    = env#allocate in
              let env, code = call env ".sexp" (n+1) false in
+             let env, code = inline_alloc env (Some (env#hash t)) (5 lor (n lsl 3)) fields code in
              env, [Mov (L (box (env#hash t)), s)] @ code
 
           | DROP ->
@@ -586,6 +651,7 @@ class env prg =
     val externs         = S.empty
     val nlabels         = 0
     val first_line      = true
+    val stackmaps       = []      (* call site stack maps              *)
                         
     method publics = S.elements publics
                    
@@ -689,6 +755,11 @@ class env prg =
     (* peeks two topmost values from the stack (the stack itself does not change) *)
     method peek2 = let x::y::_ = stack in x, y
 
+    (* peeks n topmost values from the stack, the topmost first *)
+    method peek_n n =
+      let rec take n l = if n = 0 then [] else List.hd l :: take (n-1) (List.tl l) in
+      take n stack
+
     (* tag hash: gets a hash for a string tag *)
     method hash tag =
       let h = Pervasives.ref 0 in
@@ -763,6 +834,19 @@ class env prg =
       in
       inner 0 [] stack
 
+    (* generates a label for a call site and registers its stack map: the live
+       symbolic stack slots and the number of words pushed before the call *)
+    method stack_map npushed =
+      let lab   = Printf.sprintf ".Lsm%d" nlabels in
+      let slots = List.fold_left (fun acc -> function S n when n >= 0 -> n :: acc | _ -> acc) [] stack in
+      {< nlabels = nlabels + 1; stackmaps = (lab, has_closure, static_size, self#lsize, npushed, slots) :: stackmaps >}, Label lab
+
+    (* generates a fresh local label *)
+    method new_label = Printf.sprintf ".Lal%d" nlabels, {< nlabels = nlabels + 1 >}
+
+    (* gets all stack maps *)
+    method stackmaps = List.rev stackmaps
+      
     (* generate a line number information for current function *)
     method gen_line line =
       let lab = Printf.sprintf ".L%d" nlabels in
@@ -797,6 +881,17 @@ let genasm cmd prog =
                    env#globals
               )
   in
+  let stackmaps =
+    [Meta "\t.section lama_stackmaps,\"aw\",@progbits"] @
+    List.map
+      (fun (lab, closure, nlocals, lsize, npushed, slots) ->
+        Meta (Printf.sprintf "\t.int\t%s, %d, %d, %s, %d, %d%s"
+                lab (if closure then 1 else 0) nlocals lsize npushed (List.length slots)
+                (String.concat "" @@ List.map (Printf.sprintf ", %d") slots)
+             )
+      )
+      env#stackmaps
+  in
   let asm = Buffer.create 1024 in
   List.iter
     (fun i -> Buffer.add_string asm (Printf.sprintf "%s\n" @@ show i))
@@ -805,7 +900,8 @@ let genasm cmd prog =
       globals @
       data @
       [Meta "\t.text"; Label ".Ltext"; Meta "\t.stabs \"data:t1=r1;0;4294967295;\",128,0,0,0"] @          
-      code);
+      code @
+      stackmaps);
   Buffer.contents asm
 
 let get_std_path () =
@@ -841,7 +937,7 @@ let build cmd prog =
      let objs = find_objects (fst @@ fst prog) cmd#get_include_paths in
      let buf  = Buffer.create 255 in
      List.iter (fun o -> Buffer.add_string buf o; Buffer.add_string buf " ") objs;
-     let gcc_cmdline = Printf.sprintf "gcc %s -m32 %s %s.s %s %s/runtime.a" cmd#get_debug cmd#get_output_option cmd#basename (Buffer.contents buf) inc in
+     let gcc_cmdline = Printf.sprintf "gcc %s -m32 %s %s.s %s %s/runtime.a -lpthread" cmd#get_debug cmd#get_output_option cmd#basename (Buffer.contents buf) inc in
      Sys.command gcc_cmdline
   | `Compile ->
      Sys.command (Printf.sprintf "gcc %s -m32 -c %s.s" cmd#get_debug cmd#basename)